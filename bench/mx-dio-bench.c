@@ -0,0 +1,392 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Name:
+ *	MOXA DIO Library Benchmark
+ *
+ * Description:
+ *	Microbenchmark for measuring the per-call cost of the DIO APIs and
+ *	the DIN edge to callback latency.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <mx_dio.h>
+
+#define DEFAULT_ITERATIONS 100000
+#define DEFAULT_SIM_PORTS 8
+#define EDGE_TIMEOUT_SEC 1
+
+struct bench_struct {
+	const char *name;
+	int (*func)(int port, int iter);
+};
+
+static struct mx_dio_ctx *ctx;
+static int diport;
+static int doport;
+static int json_output;
+
+static int bench_din_get_state(int port, int iter)
+{
+	int state;
+
+	(void) iter;
+	return mx_din_get_state_ctx(ctx, port, &state);
+}
+
+static int bench_din_get_all_states(int port, int iter)
+{
+	uint64_t bitmap;
+
+	(void) port;
+	(void) iter;
+	return mx_din_get_all_states_ctx(ctx, &bitmap, NULL);
+}
+
+static int bench_dout_get_state(int port, int iter)
+{
+	int state;
+
+	(void) iter;
+	return mx_dout_get_state_ctx(ctx, port, &state);
+}
+
+static int bench_dout_set_state(int port, int iter)
+{
+	return mx_dout_set_state_ctx(ctx, port, iter & 1);
+}
+
+static void bench_event(struct mx_dio_ctx *c, int port, void *arg)
+{
+	(void) c;
+	(void) port;
+	(void) arg;
+}
+
+/* register and clear in turn, while the DIN poll thread is scanning */
+static int bench_din_set_event(int port, int iter)
+{
+	if (iter & 1)
+		return mx_din_set_event_ctx(ctx, port, NULL, NULL, DIN_EVENT_CLEAR, 0);
+	return mx_din_set_event_ctx(ctx, port, bench_event, NULL, DIN_EVENT_STATE_CHANGE, 0);
+}
+
+static struct bench_struct benches[] = {
+	{ "din_get_state", bench_din_get_state },
+	{ "din_get_all_states", bench_din_get_all_states },
+	{ "dout_get_state", bench_dout_get_state },
+	{ "dout_set_state", bench_dout_set_state },
+	{ "din_set_event", bench_din_set_event },
+};
+
+void usage(FILE *fp)
+{
+	fprintf(fp, "Usage:\n");
+	fprintf(fp, "	mx-dio-bench [-n <#iterations>] [-i <#DIN port>] [-o <#DOUT port>]\n");
+	fprintf(fp, "		[-c <config> | -S [-L <latency>]] [-e <#samples> [-l <#threads>]] [-j]\n\n");
+	fprintf(fp, "OPTIONS:\n");
+	fprintf(fp, "	-n <#iterations>\n");
+	fprintf(fp, "		Calls per API (default: %d)\n", DEFAULT_ITERATIONS);
+	fprintf(fp, "	-i <#DIN port number>\n");
+	fprintf(fp, "		DIN port to read (default: 0)\n");
+	fprintf(fp, "	-o <#DOUT port number>\n");
+	fprintf(fp, "		DOUT port to read and toggle (default: 0)\n");
+	fprintf(fp, "	-c <config>\n");
+	fprintf(fp, "		Config file to use instead of the system one\n");
+	fprintf(fp, "	-S\n");
+	fprintf(fp, "		Run on the simulated (SIM) backend, DIN looped back to DOUT\n");
+	fprintf(fp, "	-L <latency>\n");
+	fprintf(fp, "		Simulated device access latency in microseconds (default: 0)\n");
+	fprintf(fp, "	-e <#samples>\n");
+	fprintf(fp, "		Measure DOUT to DIN event callback latency; the DOUT port\n");
+	fprintf(fp, "		must be wired to the DIN port (always true with -S)\n");
+	fprintf(fp, "	-l <#threads>\n");
+	fprintf(fp, "		Threads reading DIN ports during the latency test (default: 0)\n");
+	fprintf(fp, "	-j\n");
+	fprintf(fp, "		Output JSON lines\n");
+	fprintf(fp, "\n");
+	fprintf(fp, "Output:\n");
+	fprintf(fp, "	<api> <calls> <total ns> <ns per call> <ops per sec>\n");
+	fprintf(fp, "	edge_latency <samples> <p50 ns> <p99 ns> <max ns>\n");
+}
+
+static long long timespec_diff_ns(struct timespec t1, struct timespec t2)
+{
+	return (long long) (t2.tv_sec - t1.tv_sec) * 1000000000LL
+		+ (t2.tv_nsec - t1.tv_nsec);
+}
+
+static int run_bench(struct bench_struct *b, int iterations)
+{
+	struct timespec start, end;
+	long long total;
+	double per_call;
+	int port, i;
+
+	port = (b->func == bench_din_get_state ||
+		b->func == bench_din_set_event) ? diport : doport;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++) {
+		if (b->func(port, i) < 0) {
+			fprintf(stderr, "%s failed at call %d\n", b->name, i);
+			return -1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	total = timespec_diff_ns(start, end);
+	per_call = (double) total / iterations;
+	if (json_output)
+		printf("{\"bench\": \"%s\", \"calls\": %d, \"total_ns\": %lld, "
+			"\"ns_per_call\": %.1f, \"ops_per_sec\": %.0f}\n",
+			b->name, iterations, total, per_call, 1e9 / per_call);
+	else
+		printf("%s %d %lld %.1f %.0f\n", b->name, iterations, total,
+			per_call, 1e9 / per_call);
+	return 0;
+}
+
+/*
+ * DIN edge to callback latency: toggle the DOUT port and time until the
+ * callback of its looped back DIN port runs.
+ */
+static pthread_mutex_t edge_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t edge_cond = PTHREAD_COND_INITIALIZER;
+static struct timespec edge_time;
+static int edge_seen;
+static int load_stop;
+
+static void edge_callback(struct mx_dio_ctx *c, int port, void *arg)
+{
+	(void) c;
+	(void) port;
+	(void) arg;
+
+	pthread_mutex_lock(&edge_lock);
+	clock_gettime(CLOCK_MONOTONIC, &edge_time);
+	edge_seen = 1;
+	pthread_cond_signal(&edge_cond);
+	pthread_mutex_unlock(&edge_lock);
+}
+
+static void *load_thread(void *arg)
+{
+	int port = 0, state;
+
+	(void) arg;
+	while (!__atomic_load_n(&load_stop, __ATOMIC_RELAXED)) {
+		if (mx_din_get_state_ctx(ctx, port, &state) < 0)
+			port = 0;
+		else
+			port++;
+	}
+	return NULL;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *) a, y = *(const long long *) b;
+
+	return (x > y) - (x < y);
+}
+
+static int run_edge_latency(int samples, int num_of_load_threads)
+{
+	pthread_t *loads;
+	struct timespec start, timeout;
+	long long *lat;
+	int i, ret = -1, state = 0;
+
+	lat = (long long *) calloc(samples, sizeof(long long));
+	loads = (pthread_t *) calloc(num_of_load_threads + 1, sizeof(pthread_t));
+	if (lat == NULL || loads == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+
+	if (mx_dout_set_state_ctx(ctx, doport, state) < 0 ||
+		mx_din_set_event_ctx(ctx, diport, edge_callback, NULL,
+			DIN_EVENT_STATE_CHANGE, 0) < 0) {
+		fprintf(stderr, "Failed to set up DIN port %d event\n", diport);
+		goto out;
+	}
+	/* let the poll thread take the first sample */
+	usleep(100000);
+
+	for (i = 0; i < num_of_load_threads; i++)
+		pthread_create(&loads[i], NULL, load_thread, NULL);
+
+	for (i = 0; i < samples; i++) {
+		pthread_mutex_lock(&edge_lock);
+		edge_seen = 0;
+		state = !state;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (mx_dout_set_state_ctx(ctx, doport, state) < 0) {
+			pthread_mutex_unlock(&edge_lock);
+			fprintf(stderr, "Failed to set DOUT port %d\n", doport);
+			goto stop;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec += EDGE_TIMEOUT_SEC;
+		while (!edge_seen) {
+			if (pthread_cond_timedwait(&edge_cond, &edge_lock, &timeout) == ETIMEDOUT)
+				break;
+		}
+		if (!edge_seen) {
+			pthread_mutex_unlock(&edge_lock);
+			fprintf(stderr, "No event on DIN port %d: is DOUT port %d wired to it?\n",
+				diport, doport);
+			goto stop;
+		}
+		lat[i] = timespec_diff_ns(start, edge_time);
+		pthread_mutex_unlock(&edge_lock);
+	}
+
+	qsort(lat, samples, sizeof(long long), cmp_ll);
+	if (json_output)
+		printf("{\"bench\": \"edge_latency\", \"samples\": %d, \"load_threads\": %d, "
+			"\"p50_ns\": %lld, \"p99_ns\": %lld, \"max_ns\": %lld}\n",
+			samples, num_of_load_threads, lat[samples / 2],
+			lat[samples * 99 / 100], lat[samples - 1]);
+	else
+		printf("edge_latency %d %lld %lld %lld\n", samples, lat[samples / 2],
+			lat[samples * 99 / 100], lat[samples - 1]);
+	ret = 0;
+
+stop:
+	__atomic_store_n(&load_stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < num_of_load_threads; i++)
+		pthread_join(loads[i], NULL);
+	mx_din_set_event_ctx(ctx, diport, NULL, NULL, DIN_EVENT_CLEAR, 0);
+out:
+	free(loads);
+	free(lat);
+	return ret;
+}
+
+/*
+ * Write a SIM backend config with DIN ports looped back to DOUT ports and
+ * open it. The file is only needed while opening.
+ */
+static int open_sim(int latency)
+{
+	char path[] = "/tmp/mx-dio-bench-XXXXXX";
+	FILE *fp;
+	int fd, ret;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+
+	fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	fprintf(fp, "{\n");
+	fprintf(fp, "	\"CONFIG_VERSION\": \"1.1.0\",\n");
+	fprintf(fp, "	\"METHOD\": \"SIM\",\n");
+	fprintf(fp, "	\"NUM_OF_DIN_PORTS\": %d,\n", DEFAULT_SIM_PORTS);
+	fprintf(fp, "	\"NUM_OF_DOUT_PORTS\": %d,\n", DEFAULT_SIM_PORTS);
+	fprintf(fp, "	\"SIM_ACCESS_LATENCY\": %d,\n", latency);
+	fprintf(fp, "	\"SIM_DIN_LOOPBACK\": 1,\n");
+	fprintf(fp, "	\"DIN_PORT_POLLING_INTERVAL\": 100\n");
+	fprintf(fp, "}\n");
+	fclose(fp);
+
+	ret = mx_dio_open(path, &ctx);
+	unlink(path);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *conf_path = NULL;
+	int iterations = DEFAULT_ITERATIONS;
+	int sim = 0, sim_latency = 0, edge_samples = 0, load_threads = 0;
+	unsigned int i;
+	int c, ret;
+
+	while (1) {
+		c = getopt(argc, argv, "hn:i:o:c:SL:e:l:j");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			usage(stdout);
+			exit(0);
+		case 'n':
+			iterations = atoi(optarg);
+			if (iterations <= 0) {
+				fprintf(stderr, "%s is not a valid iteration count\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'i':
+			diport = atoi(optarg);
+			break;
+		case 'o':
+			doport = atoi(optarg);
+			break;
+		case 'c':
+			conf_path = optarg;
+			break;
+		case 'S':
+			sim = 1;
+			break;
+		case 'L':
+			sim_latency = atoi(optarg);
+			break;
+		case 'e':
+			edge_samples = atoi(optarg);
+			if (edge_samples <= 0) {
+				fprintf(stderr, "%s is not a valid sample count\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'l':
+			load_threads = atoi(optarg);
+			if (load_threads < 0) {
+				fprintf(stderr, "%s is not a valid thread count\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'j':
+			json_output = 1;
+			break;
+		default:
+			usage(stderr);
+			exit(99);
+		}
+	}
+
+	if (sim)
+		ret = open_sim(sim_latency);
+	else
+		ret = mx_dio_open(conf_path, &ctx);
+	if (ret < 0) {
+		fprintf(stderr, "Initialize Moxa dio control library failed\n");
+		exit(1);
+	}
+
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		if (run_bench(&benches[i], iterations) < 0)
+			exit(1);
+	}
+
+	if (edge_samples > 0 && run_edge_latency(edge_samples, load_threads) < 0)
+		exit(1);
+
+	mx_dio_close(ctx);
+	exit(0);
+}
@@ -17,11 +17,17 @@
 #ifndef _MOXA_DIO_H
 #define _MOXA_DIO_H
 
+#include <stdint.h>
+#include <time.h>
+
 enum dio_state {
 	DIO_STATE_LOW = 0,
 	DIO_STATE_HIGH = 1
 };
 
+/* opaque handle for one DIO configuration, see mx_dio_open() */
+struct mx_dio_ctx;
+
 enum din_event_mode {
 	DIN_EVENT_CLEAR = -1,
 	DIN_EVENT_LOW_TO_HIGH = 0,
@@ -29,17 +35,241 @@ enum din_event_mode {
 	DIN_EVENT_STATE_CHANGE = 2
 };
 
+struct mx_din_event {
+	uint64_t seq;		/* gaps mean records were dropped on overrun */
+	uint64_t timestamp;	/* CLOCK_MONOTONIC, in nanoseconds */
+	uint16_t port;
+	uint8_t old_state;
+	uint8_t new_state;
+};
+
+struct mx_din_dispatch_stats {
+	uint64_t queued;		/* events handed to dispatcher threads */
+	uint64_t dispatched;		/* callbacks completed */
+	uint64_t dropped;		/* events dropped on a full queue */
+	uint32_t queue_depth;		/* events currently queued */
+	uint32_t max_queue_depth;
+	uint64_t callback_time_total;	/* in nanoseconds */
+	uint64_t callback_time_max;	/* in nanoseconds */
+};
+
+struct mx_din_poll_timing {
+	uint64_t wakeups;	/* timed wakeups of the DIN poll thread */
+	uint64_t jitter_total;	/* sum of wakeup lateness, in ns */
+	uint64_t jitter_max;	/* in ns */
+	uint64_t overruns;	/* port polls skipped because the thread fell behind */
+};
+
+/*
+ * Sequence-of-events recorder file, see RECORDER_FILE in the config: a
+ * struct mx_dio_recorder_header followed by capacity struct mx_dio_record
+ * slots. Record seq goes into slot (seq - 1) % capacity; a slot whose seq
+ * is 0 is unused or was being written.
+ */
+#define MX_DIO_RECORDER_MAGIC "MXDIOSOE"
+#define MX_DIO_RECORDER_VERSION 1
+
+enum dio_record_direction {
+	DIO_RECORD_DIN = 0,
+	DIO_RECORD_DOUT = 1
+};
+
+enum dio_record_source {
+	DIO_RECORD_SRC_SAMPLE = 0,	/* DIN transition seen by the poll thread */
+	DIO_RECORD_SRC_EVENT = 1,	/* DIN event fired to its callback */
+	DIO_RECORD_SRC_SET = 2,		/* DOUT written by an application */
+	DIO_RECORD_SRC_PULSE = 3	/* DOUT written by the pulse engine */
+};
+
+#define DIO_RECORD_STATE_UNKNOWN 0xff
+
+struct mx_dio_recorder_header {
+	char magic[8];			/* MX_DIO_RECORDER_MAGIC, not terminated */
+	uint32_t version;
+	uint32_t record_size;		/* sizeof(struct mx_dio_record) */
+	uint64_t capacity;		/* records, a power of two */
+	uint64_t head;			/* seq of the newest record */
+	int64_t realtime_offset;	/* CLOCK_REALTIME - CLOCK_MONOTONIC, in ns */
+	char boot_id[40];		/* of the boot the timestamps belong to */
+	uint8_t reserved[48];
+};
+
+struct mx_dio_record {
+	uint64_t seq;		/* from 1, 0 while being written */
+	uint64_t timestamp;	/* CLOCK_MONOTONIC, in nanoseconds */
+	uint16_t port;
+	uint8_t direction;	/* enum dio_record_direction */
+	uint8_t old_state;	/* DIO_RECORD_STATE_UNKNOWN if not known */
+	uint8_t new_state;
+	uint8_t source;		/* enum dio_record_source */
+	uint8_t reserved[2];
+};
+
+/*
+ * Pulse counter of a DIN port. period and frequency are estimated from the
+ * rising edges of the last DIN_COUNTER_WINDOW, and are 0 with fewer than
+ * two rising edges in it.
+ */
+struct mx_din_counter {
+	uint64_t rising;	/* LOW to HIGH transitions */
+	uint64_t falling;	/* HIGH to LOW transitions */
+	uint64_t last_edge;	/* CLOCK_MONOTONIC, in ns, 0 if none yet */
+	uint64_t period;	/* mean rising edge to rising edge, in ns */
+	double frequency;	/* in Hz */
+};
+
+/*
+ * Scheduling of the DIN poll thread. policy is SCHED_OTHER, SCHED_FIFO or
+ * SCHED_RR from <sched.h>.
+ */
+struct mx_din_poll_thread_attr {
+	int policy;
+	int priority;		/* 1 to 99 with SCHED_FIFO and SCHED_RR, else 0 */
+	uint64_t cpus;		/* bit N allows CPU N, 0 for all CPUs */
+	size_t stack_size;	/* in bytes, 0 for the default */
+	int lock_memory;	/* pre-fault and mlock the library's working set */
+};
+
+/*
+ * Requested against achieved timing of the waveform of a DOUT port, reset
+ * when a new pulse, pulse train or PWM is started on it. An edge takes
+ * effect when its write returns.
+ */
+struct mx_dout_pulse_stats {
+	uint64_t requested_period;	/* in ns, 0 for a single pulse */
+	uint64_t requested_width;	/* HIGH time, in ns */
+	uint64_t pulses;		/* completed HIGH pulses */
+	uint64_t width_total;		/* achieved HIGH time, in ns */
+	uint64_t width_min;
+	uint64_t width_max;
+	uint64_t periods;		/* rising edge to rising edge */
+	uint64_t period_total;		/* achieved, in ns */
+	uint64_t period_min;
+	uint64_t period_max;
+	uint64_t lateness_total;	/* edges taking effect after their deadline, in ns */
+	uint64_t lateness_max;
+	uint64_t overruns;		/* edges so late that timing restarted from them */
+	uint64_t errors;		/* failed writes */
+	int running;			/* the waveform has not ended yet */
+};
+
+#define MX_DIO_MAX_PORTS	64
+#define MX_DIO_HIST_BUCKETS	32
+
+/*
+ * log2 latency histogram: buckets[i] counts samples of [2^i, 2^(i+1)) ns,
+ * bucket 0 also counts 0 ns and the last bucket everything above.
+ */
+struct mx_dio_hist {
+	uint64_t count;
+	uint64_t total;		/* in ns */
+	uint64_t max;		/* in ns */
+	uint64_t buckets[MX_DIO_HIST_BUCKETS];
+};
+
+struct mx_dio_op_stats {
+	uint64_t calls;
+	uint64_t errors;
+	struct mx_dio_hist latency;
+};
+
+struct mx_dio_event_stats {
+	uint64_t count;
+	uint64_t total;		/* in ns */
+	uint64_t max;		/* in ns */
+};
+
+struct mx_dio_stats {
+	struct mx_dio_op_stats din_read;	/* one DIN port or bulk read */
+	struct mx_dio_op_stats dout_read;	/* one DOUT port read */
+	struct mx_dio_op_stats dout_write;	/* one DOUT set or multi-set */
+	struct mx_dio_hist poll_cycle;		/* DIN poll thread work per cycle */
+	uint64_t poll_overruns;
+	struct mx_dio_hist event_latency_all;	/* detection to callback return */
+	struct mx_dio_event_stats event_latency[MX_DIO_MAX_PORTS];
+	uint64_t dout_cached_reads;		/* DOUT reads served by the shadow */
+	uint64_t dout_verifies;			/* shadow verification passes */
+	uint64_t dout_mismatches;		/* ports changed behind the library */
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 extern int mx_dio_init(void);
+extern int mx_dio_get_num_of_ports(int *num_of_din_ports, int *num_of_dout_ports);
 extern int mx_dout_set_state(int doport, int state);
 extern int mx_dout_get_state(int doport, int *state);
 extern int mx_din_get_state(int diport, int *state);
-// extern int mx_dout_set_multi_state(u32 set_bits, u32 clear_bits);
+extern int mx_din_get_all_states(uint64_t *bitmap, struct timespec *ts);
+extern int mx_dout_set_multi_state(uint64_t set_bits, uint64_t clear_bits);
+extern int mx_dout_set_shadow(int enable, unsigned long verify_interval);
+extern int mx_dout_get_shadow(int *enable, unsigned long *verify_interval);
+extern int mx_dout_verify_shadow(uint64_t *mismatched);
+extern int mx_dout_pulse(int doport, unsigned long width);
+extern int mx_dout_pulse_train(int doport, unsigned long period, unsigned long width, unsigned long count);
+extern int mx_dout_pwm(int doport, unsigned long period, unsigned int duty);
+extern int mx_dout_stop_pulse(int doport);
+extern int mx_dout_get_pulse_stats(int doport, struct mx_dout_pulse_stats *stats);
 extern int mx_din_set_event(int diport, void (*func)(int diport), int mode, unsigned long duration);
 extern int mx_din_get_event(int diport, int *mode, unsigned long *duration);
+extern int mx_din_set_polling_interval(int diport, unsigned long interval);
+extern int mx_din_get_polling_interval(int diport, unsigned long *interval);
+extern int mx_din_set_debounce(int diport, unsigned int samples);
+extern int mx_din_get_debounce(int diport, unsigned int *samples);
+extern int mx_din_get_poll_timing(struct mx_din_poll_timing *timing);
+extern int mx_din_set_poll_thread_attr(const struct mx_din_poll_thread_attr *attr);
+extern int mx_din_get_poll_thread_attr(struct mx_din_poll_thread_attr *attr);
+extern int mx_din_set_counter(int diport, int enable);
+extern int mx_din_get_counter(int diport, struct mx_din_counter *counter);
+extern int mx_din_get_all_counters(struct mx_din_counter *counters, size_t max);
+extern int mx_din_reset_counter(int diport);
+extern int mx_din_set_event_buffer(unsigned int size);
+extern int mx_din_read_events(struct mx_din_event *buf, size_t max);
+extern int mx_din_get_event_fd(void);
+extern int mx_din_set_dispatch_threads(int num_of_threads);
+extern int mx_din_get_dispatch_stats(struct mx_din_dispatch_stats *stats);
+extern int mx_dio_get_stats(struct mx_dio_stats *stats);
+extern int mx_dio_reset_stats(void);
+
+extern int mx_dio_open(const char *conf_path, struct mx_dio_ctx **ctx);
+extern int mx_dio_close(struct mx_dio_ctx *ctx);
+extern int mx_dio_get_num_of_ports_ctx(struct mx_dio_ctx *ctx, int *num_of_din_ports, int *num_of_dout_ports);
+extern int mx_dout_set_state_ctx(struct mx_dio_ctx *ctx, int doport, int state);
+extern int mx_dout_get_state_ctx(struct mx_dio_ctx *ctx, int doport, int *state);
+extern int mx_din_get_state_ctx(struct mx_dio_ctx *ctx, int diport, int *state);
+extern int mx_din_get_all_states_ctx(struct mx_dio_ctx *ctx, uint64_t *bitmap, struct timespec *ts);
+extern int mx_dout_set_multi_state_ctx(struct mx_dio_ctx *ctx, uint64_t set_bits, uint64_t clear_bits);
+extern int mx_dout_set_shadow_ctx(struct mx_dio_ctx *ctx, int enable, unsigned long verify_interval);
+extern int mx_dout_get_shadow_ctx(struct mx_dio_ctx *ctx, int *enable, unsigned long *verify_interval);
+extern int mx_dout_verify_shadow_ctx(struct mx_dio_ctx *ctx, uint64_t *mismatched);
+extern int mx_dout_pulse_ctx(struct mx_dio_ctx *ctx, int doport, unsigned long width);
+extern int mx_dout_pulse_train_ctx(struct mx_dio_ctx *ctx, int doport, unsigned long period, unsigned long width, unsigned long count);
+extern int mx_dout_pwm_ctx(struct mx_dio_ctx *ctx, int doport, unsigned long period, unsigned int duty);
+extern int mx_dout_stop_pulse_ctx(struct mx_dio_ctx *ctx, int doport);
+extern int mx_dout_get_pulse_stats_ctx(struct mx_dio_ctx *ctx, int doport, struct mx_dout_pulse_stats *stats);
+extern int mx_din_set_event_ctx(struct mx_dio_ctx *ctx, int diport,
+	void (*func)(struct mx_dio_ctx *ctx, int diport, void *arg), void *arg,
+	int mode, unsigned long duration);
+extern int mx_din_get_event_ctx(struct mx_dio_ctx *ctx, int diport, int *mode, unsigned long *duration);
+extern int mx_din_set_polling_interval_ctx(struct mx_dio_ctx *ctx, int diport, unsigned long interval);
+extern int mx_din_get_polling_interval_ctx(struct mx_dio_ctx *ctx, int diport, unsigned long *interval);
+extern int mx_din_set_debounce_ctx(struct mx_dio_ctx *ctx, int diport, unsigned int samples);
+extern int mx_din_get_debounce_ctx(struct mx_dio_ctx *ctx, int diport, unsigned int *samples);
+extern int mx_din_get_poll_timing_ctx(struct mx_dio_ctx *ctx, struct mx_din_poll_timing *timing);
+extern int mx_din_set_poll_thread_attr_ctx(struct mx_dio_ctx *ctx, const struct mx_din_poll_thread_attr *attr);
+extern int mx_din_get_poll_thread_attr_ctx(struct mx_dio_ctx *ctx, struct mx_din_poll_thread_attr *attr);
+extern int mx_din_set_counter_ctx(struct mx_dio_ctx *ctx, int diport, int enable);
+extern int mx_din_get_counter_ctx(struct mx_dio_ctx *ctx, int diport, struct mx_din_counter *counter);
+extern int mx_din_get_all_counters_ctx(struct mx_dio_ctx *ctx, struct mx_din_counter *counters, size_t max);
+extern int mx_din_reset_counter_ctx(struct mx_dio_ctx *ctx, int diport);
+extern int mx_din_set_event_buffer_ctx(struct mx_dio_ctx *ctx, unsigned int size);
+extern int mx_din_read_events_ctx(struct mx_dio_ctx *ctx, struct mx_din_event *buf, size_t max);
+extern int mx_din_get_event_fd_ctx(struct mx_dio_ctx *ctx);
+extern int mx_din_set_dispatch_threads_ctx(struct mx_dio_ctx *ctx, int num_of_threads);
+extern int mx_din_get_dispatch_stats_ctx(struct mx_dio_ctx *ctx, struct mx_din_dispatch_stats *stats);
+extern int mx_dio_get_stats_ctx(struct mx_dio_ctx *ctx, struct mx_dio_stats *stats);
+extern int mx_dio_reset_stats_ctx(struct mx_dio_ctx *ctx);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,286 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Name:
+ *	MOXA DIO Library
+ *
+ * Description:
+ *	GPIO backend: DIN/DOUT ports on sysfs GPIO lines, with DIN edges
+ *	reported by the kernel through POLLPRI on the value files.
+ *
+ * Authors:
+ *	2018	Ken CJ Chou	<KenCJ.Chou@moxa.com>
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <moxa/mx_gpio.h>
+#include "mx_dio_internal.h"
+
+#define GPIO_SYSFS_DIR "/sys/class/gpio"
+
+struct gpio_priv {
+	int din_gpio[MAX_DIO_PORTS];
+	int dout_gpio[MAX_DIO_PORTS];
+	int value_fd[MAX_DIO_PORTS];	/* DIN poll thread only, in edge mode */
+	char edge[MAX_DIO_PORTS][8];	/* edge attribute before edge mode, "" if unset */
+};
+
+static int load_gpio_nums(struct json_object *conf, char *key, int *gpio_nums,
+	int num_of_ports)
+{
+	struct array_list *arr;
+	int i;
+
+	if (obj_get_arr(conf, key, &arr) < 0)
+		return -5; /* E_CONFERR */
+
+	for (i = 0; i < num_of_ports; i++) {
+		if (arr_get_int(arr, i, &gpio_nums[i]) < 0)
+			return -5; /* E_CONFERR */
+	}
+	return 0;
+}
+
+static int write_gpio_sysfs(int gpio_num, const char *attr, const char *val)
+{
+	char path[MAX_FILEPATH_LEN];
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), GPIO_SYSFS_DIR "/gpio%d/%s", gpio_num, attr);
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (write(fd, val, strlen(val)) < 0)
+		ret = -1;
+	close(fd);
+
+	return ret;
+}
+
+static int read_gpio_sysfs(int gpio_num, const char *attr, char *val, size_t len)
+{
+	char path[MAX_FILEPATH_LEN];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), GPIO_SYSFS_DIR "/gpio%d/%s", gpio_num, attr);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	n = read(fd, val, len - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+
+	val[n] = '\0';
+	if (val[n - 1] == '\n')
+		val[n - 1] = '\0';
+	return 0;
+}
+
+static int read_value_fd(int fd, int *state)
+{
+	char c;
+
+	if (pread(fd, &c, 1, 0) != 1)
+		return -1;
+
+	*state = (c == '1') ? DIO_STATE_HIGH : DIO_STATE_LOW;
+	return 0;
+}
+
+static int gpio_init(struct dio_backend *be, struct json_object *conf)
+{
+	struct gpio_priv *p;
+	int ret, i;
+
+	p = (struct gpio_priv *) calloc(1, sizeof(struct gpio_priv));
+	if (p == NULL)
+		return -1; /* E_SYSFUNCERR */
+
+	for (i = 0; i < MAX_DIO_PORTS; i++)
+		p->value_fd[i] = -1;
+
+	if (be->num_of_din_ports > 0) {
+		ret = load_gpio_nums(conf, "GPIO_NUMS_OF_DIN_PORTS",
+			p->din_gpio, be->num_of_din_ports);
+		if (ret < 0)
+			goto err;
+	}
+
+	if (be->num_of_dout_ports > 0) {
+		ret = load_gpio_nums(conf, "GPIO_NUMS_OF_DOUT_PORTS",
+			p->dout_gpio, be->num_of_dout_ports);
+		if (ret < 0)
+			goto err;
+	}
+
+	be->priv = p;
+	return 0;
+err:
+	free(p);
+	return ret;
+}
+
+static void gpio_close(struct dio_backend *be)
+{
+	free(be->priv);
+}
+
+static int gpio_read_din(struct dio_backend *be, int diport, int *state)
+{
+	struct gpio_priv *p = (struct gpio_priv *) be->priv;
+	int ret;
+
+	ret = mx_gpio_get_value(p->din_gpio[diport], state);
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
+static int gpio_read_dout(struct dio_backend *be, int doport, int *state)
+{
+	struct gpio_priv *p = (struct gpio_priv *) be->priv;
+	int ret;
+
+	ret = mx_gpio_get_value(p->dout_gpio[doport], state);
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
+static int gpio_write_dout(struct dio_backend *be, int doport, int state)
+{
+	struct gpio_priv *p = (struct gpio_priv *) be->priv;
+	int ret;
+
+	ret = mx_gpio_set_value(p->dout_gpio[doport],
+		(state == DIO_STATE_HIGH) ? GPIO_VALUE_HIGH : GPIO_VALUE_LOW);
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
+static void gpio_stop_events(struct dio_backend *be)
+{
+	struct gpio_priv *p = (struct gpio_priv *) be->priv;
+	int i;
+
+	for (i = 0; i < be->num_of_din_ports; i++) {
+		if (p->value_fd[i] >= 0)
+			close(p->value_fd[i]);
+		p->value_fd[i] = -1;
+
+		/* stop the line from raising interrupts nobody waits for */
+		if (p->edge[i][0] != '\0')
+			write_gpio_sysfs(p->din_gpio[i], "edge", p->edge[i]);
+		p->edge[i][0] = '\0';
+	}
+}
+
+static int gpio_start_events(struct dio_backend *be)
+{
+	struct gpio_priv *p = (struct gpio_priv *) be->priv;
+	char path[MAX_FILEPATH_LEN];
+	int i, state;
+
+	for (i = 0; i < be->num_of_din_ports; i++) {
+		if (read_gpio_sysfs(p->din_gpio[i], "edge", p->edge[i], sizeof(p->edge[i])) < 0)
+			goto err;
+
+		if (write_gpio_sysfs(p->din_gpio[i], "edge", "both") < 0) {
+			p->edge[i][0] = '\0';
+			goto err;
+		}
+
+		snprintf(path, sizeof(path), GPIO_SYSFS_DIR "/gpio%d/value", p->din_gpio[i]);
+		p->value_fd[i] = open(path, O_RDONLY | O_CLOEXEC);
+		if (p->value_fd[i] < 0)
+			goto err;
+
+		/* consume the initial POLLPRI */
+		if (read_value_fd(p->value_fd[i], &state) < 0)
+			goto err;
+	}
+	return 0;
+err:
+	gpio_stop_events(be);
+	return -1;
+}
+
+/*
+ * sysfs only tells that a line changed, so an edge carries the level read
+ * after the wakeup, which may already be back at the previous level.
+ */
+static int gpio_wait_events(struct dio_backend *be, uint64_t watched,
+	uint64_t deadline, struct din_edge *edges, int max_edges, int *woken)
+{
+	struct gpio_priv *p = (struct gpio_priv *) be->priv;
+	struct pollfd fds[MAX_DIO_PORTS + 1];
+	struct timespec timeout;
+	uint64_t wake, now, ts;
+	int ret, state, n = 0, i;
+
+	*woken = 0;
+
+	fds[0].fd = be->wake_fd;
+	fds[0].events = POLLIN;
+	for (i = 0; i < be->num_of_din_ports; i++) {
+		fds[i + 1].fd = (watched & (1ULL << i)) ? p->value_fd[i] : -1;
+		fds[i + 1].events = POLLPRI | POLLERR;
+	}
+
+	if (deadline != UINT64_MAX) {
+		now = get_monotonic_ns();
+		ns_to_timespec((deadline > now) ? deadline - now : 0, &timeout);
+		ret = ppoll(fds, be->num_of_din_ports + 1, &timeout, NULL);
+	} else {
+		ret = ppoll(fds, be->num_of_din_ports + 1, NULL, NULL);
+	}
+	if (ret <= 0)
+		return ret;
+
+	if (fds[0].revents & POLLIN) {
+		if (read(be->wake_fd, &wake, sizeof(wake)) > 0)
+			*woken = 1;
+	}
+
+	ts = get_monotonic_ns();
+	for (i = 0; i < be->num_of_din_ports && n < max_edges; i++) {
+		if (!(fds[i + 1].revents & (POLLPRI | POLLERR)))
+			continue;
+		if (read_value_fd(p->value_fd[i], &state) < 0)
+			continue;
+
+		edges[n].diport = i;
+		edges[n].state = state;
+		edges[n].ts = ts;
+		n++;
+	}
+	return n;
+}
+
+/* libmx_gpio_ctl has no bulk line access: one call per line */
+const struct dio_backend_ops dio_backend_gpio = {
+	.name = "GPIO",
+	.caps = DIO_BACKEND_EDGE_EVENTS,
+	.init = gpio_init,
+	.close = gpio_close,
+	.read_din = gpio_read_din,
+	.read_dout = gpio_read_dout,
+	.write_dout = gpio_write_dout,
+	.start_events = gpio_start_events,
+	.wait_events = gpio_wait_events,
+	.stop_events = gpio_stop_events,
+};
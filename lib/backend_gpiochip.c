@@ -0,0 +1,472 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Name:
+ *	MOXA DIO Library
+ *
+ * Description:
+ *	GPIOCHIP backend: DIN/DOUT ports on lines of GPIO character devices
+ *	(/dev/gpiochipN, v2 uAPI). All lines of a chip are requested once, so
+ *	a scan of any number of ports is one ioctl per chip, and DIN edges
+ *	come from the kernel with CLOCK_MONOTONIC timestamps.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include "mx_dio_internal.h"
+
+#define MAX_GPIOCHIP_BANKS 8	/* distinct chips per port direction */
+#define GPIOCHIP_CONSUMER "mx-dio"
+
+/* the lines of one chip, held by one line request */
+struct gpiochip_bank {
+	char path[MAX_FILEPATH_LEN];
+	int fd;					/* line request fd */
+	int num_of_lines;
+	uint32_t offsets[GPIO_V2_LINES_MAX];
+	int ports[GPIO_V2_LINES_MAX];		/* port of each line */
+};
+
+struct gpiochip_lines {
+	int num_of_banks;
+	struct gpiochip_bank banks[MAX_GPIOCHIP_BANKS];
+	int bank[MAX_DIO_PORTS];	/* bank of each port */
+	int line[MAX_DIO_PORTS];	/* line of each port within its bank */
+};
+
+struct gpiochip_priv {
+	struct gpiochip_lines din;
+	struct gpiochip_lines dout;
+};
+
+static inline uint64_t line_mask_all(int num_of_lines)
+{
+	return (num_of_lines == 64) ? ~0ULL : (1ULL << num_of_lines) - 1;
+}
+
+/*
+ * The chip key is either one path for all ports or an array with a path
+ * per port; the lines key is an array with the line offset of each port.
+ */
+static int load_gpiochip_lines(struct json_object *conf, char *chip_key,
+	char *lines_key, int num_of_ports, struct gpiochip_lines *l)
+{
+	struct json_object *chips, *chip;
+	struct array_list *offsets;
+	struct gpiochip_bank *b;
+	const char *path;
+	int i, k, offset;
+
+	if (obj_get_obj(conf, chip_key, &chips) < 0)
+		return -5; /* E_CONFERR */
+
+	if (obj_get_arr(conf, lines_key, &offsets) < 0)
+		return -5; /* E_CONFERR */
+
+	for (i = 0; i < num_of_ports; i++) {
+		if (json_object_is_type(chips, json_type_array)) {
+			if (arr_get_obj(json_object_get_array(chips), i, &chip) < 0)
+				return -5; /* E_CONFERR */
+			path = json_object_get_string(chip);
+		} else {
+			path = json_object_get_string(chips);
+		}
+		if (path == NULL || strlen(path) >= MAX_FILEPATH_LEN)
+			return -5; /* E_CONFERR */
+
+		if (arr_get_int(offsets, i, &offset) < 0 || offset < 0)
+			return -5; /* E_CONFERR */
+
+		for (k = 0; k < l->num_of_banks; k++) {
+			if (strcmp(l->banks[k].path, path) == 0)
+				break;
+		}
+		if (k == l->num_of_banks) {
+			if (k == MAX_GPIOCHIP_BANKS)
+				return -5; /* E_CONFERR */
+			strcpy(l->banks[k].path, path);
+			l->banks[k].fd = -1;
+			l->num_of_banks++;
+		}
+
+		b = &l->banks[k];
+		l->bank[i] = k;
+		l->line[i] = b->num_of_lines;
+		b->offsets[b->num_of_lines] = offset;
+		b->ports[b->num_of_lines] = i;
+		b->num_of_lines++;
+	}
+	return 0;
+}
+
+static int request_bank(struct gpiochip_bank *b, uint64_t flags)
+{
+	struct gpio_v2_line_request req;
+	int fd, ret;
+
+	fd = open(b->path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	memset(&req, 0, sizeof(req));
+	memcpy(req.offsets, b->offsets, b->num_of_lines * sizeof(uint32_t));
+	strcpy(req.consumer, GPIOCHIP_CONSUMER);
+	req.num_lines = b->num_of_lines;
+	req.config.flags = flags;
+
+	ret = ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req);
+	close(fd);
+	if (ret < 0)
+		return -1;
+
+	/* edge events are drained without blocking */
+	if (fcntl(req.fd, F_SETFL, O_NONBLOCK) < 0) {
+		close(req.fd);
+		return -1;
+	}
+
+	b->fd = req.fd;
+	return 0;
+}
+
+/*
+ * DOUT lines are requested without a direction first, so requesting them
+ * does not reset the levels the outputs already drive.
+ */
+static int request_dout_bank(struct gpiochip_bank *b)
+{
+	struct gpio_v2_line_config cfg;
+	struct gpio_v2_line_values vals;
+
+	if (request_bank(b, 0) < 0)
+		return -1;
+
+	vals.mask = line_mask_all(b->num_of_lines);
+	if (ioctl(b->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &vals) < 0)
+		return -1;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+	cfg.num_attrs = 1;
+	cfg.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+	cfg.attrs[0].attr.values = vals.bits;
+	cfg.attrs[0].mask = vals.mask;
+	if (ioctl(b->fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &cfg) < 0)
+		return -1;
+	return 0;
+}
+
+static void release_banks(struct gpiochip_lines *l)
+{
+	int k;
+
+	for (k = 0; k < l->num_of_banks; k++) {
+		if (l->banks[k].fd >= 0)
+			close(l->banks[k].fd);
+		l->banks[k].fd = -1;
+	}
+}
+
+static void gpiochip_close(struct dio_backend *be)
+{
+	struct gpiochip_priv *p = (struct gpiochip_priv *) be->priv;
+
+	release_banks(&p->din);
+	release_banks(&p->dout);
+	free(p);
+}
+
+static int gpiochip_init(struct dio_backend *be, struct json_object *conf)
+{
+	struct gpiochip_priv *p;
+	int ret, k;
+
+	p = (struct gpiochip_priv *) calloc(1, sizeof(struct gpiochip_priv));
+	if (p == NULL)
+		return -1; /* E_SYSFUNCERR */
+
+	if (be->num_of_din_ports > 0) {
+		ret = load_gpiochip_lines(conf, "GPIOCHIP_OF_DIN_PORTS",
+			"GPIO_LINES_OF_DIN_PORTS", be->num_of_din_ports, &p->din);
+		if (ret < 0) {
+			free(p);
+			return ret;
+		}
+	}
+
+	if (be->num_of_dout_ports > 0) {
+		ret = load_gpiochip_lines(conf, "GPIOCHIP_OF_DOUT_PORTS",
+			"GPIO_LINES_OF_DOUT_PORTS", be->num_of_dout_ports, &p->dout);
+		if (ret < 0) {
+			free(p);
+			return ret;
+		}
+	}
+
+	be->priv = p;
+
+	for (k = 0; k < p->din.num_of_banks; k++) {
+		if (request_bank(&p->din.banks[k], GPIO_V2_LINE_FLAG_INPUT) < 0)
+			goto err;
+	}
+
+	for (k = 0; k < p->dout.num_of_banks; k++) {
+		if (request_dout_bank(&p->dout.banks[k]) < 0)
+			goto err;
+	}
+	return 0;
+err:
+	gpiochip_close(be);
+	be->priv = NULL;
+	return -1; /* E_SYSFUNCERR */
+}
+
+static int get_line(struct gpiochip_lines *l, int port, int *state)
+{
+	struct gpio_v2_line_values vals;
+
+	vals.mask = 1ULL << l->line[port];
+	if (ioctl(l->banks[l->bank[port]].fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &vals) < 0)
+		return -1; /* E_SYSFUNCERR */
+
+	*state = (vals.bits & vals.mask) ? DIO_STATE_HIGH : DIO_STATE_LOW;
+	return 0;
+}
+
+static int gpiochip_read_din(struct dio_backend *be, int diport, int *state)
+{
+	struct gpiochip_priv *p = (struct gpiochip_priv *) be->priv;
+
+	return get_line(&p->din, diport, state);
+}
+
+static int gpiochip_read_dout(struct dio_backend *be, int doport, int *state)
+{
+	struct gpiochip_priv *p = (struct gpiochip_priv *) be->priv;
+
+	return get_line(&p->dout, doport, state);
+}
+
+static int gpiochip_write_dout(struct dio_backend *be, int doport, int state)
+{
+	struct gpiochip_priv *p = (struct gpiochip_priv *) be->priv;
+	struct gpio_v2_line_values vals;
+
+	vals.mask = 1ULL << p->dout.line[doport];
+	vals.bits = (state == DIO_STATE_HIGH) ? vals.mask : 0;
+	if (ioctl(p->dout.banks[p->dout.bank[doport]].fd,
+		GPIO_V2_LINE_SET_VALUES_IOCTL, &vals) < 0)
+		return -1; /* E_SYSFUNCERR */
+	return 0;
+}
+
+/* one GET_VALUES per chip holding a port in mask */
+static uint64_t gpiochip_read_din_bulk(struct dio_backend *be, uint64_t mask,
+	uint64_t *bitmap)
+{
+	struct gpiochip_priv *p = (struct gpiochip_priv *) be->priv;
+	struct gpiochip_bank *b;
+	struct gpio_v2_line_values vals;
+	uint64_t ok = 0, states = 0, bank_ports;
+	int k, j;
+
+	for (k = 0; k < p->din.num_of_banks; k++) {
+		b = &p->din.banks[k];
+
+		vals.mask = 0;
+		bank_ports = 0;
+		for (j = 0; j < b->num_of_lines; j++) {
+			if (mask & (1ULL << b->ports[j])) {
+				vals.mask |= 1ULL << j;
+				bank_ports |= 1ULL << b->ports[j];
+			}
+		}
+		if (vals.mask == 0)
+			continue;
+
+		if (ioctl(b->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &vals) < 0)
+			continue;
+
+		ok |= bank_ports;
+		for (j = 0; j < b->num_of_lines; j++) {
+			if (vals.bits & vals.mask & (1ULL << j))
+				states |= 1ULL << b->ports[j];
+		}
+	}
+
+	*bitmap = states;
+	return ok;
+}
+
+/* one SET_VALUES per chip holding a port to change */
+static int gpiochip_write_dout_bulk(struct dio_backend *be, uint64_t set_bits,
+	uint64_t clear_bits)
+{
+	struct gpiochip_priv *p = (struct gpiochip_priv *) be->priv;
+	struct gpiochip_bank *b;
+	struct gpio_v2_line_values vals;
+	int k, j;
+
+	for (k = 0; k < p->dout.num_of_banks; k++) {
+		b = &p->dout.banks[k];
+
+		vals.mask = 0;
+		vals.bits = 0;
+		for (j = 0; j < b->num_of_lines; j++) {
+			if ((set_bits | clear_bits) & (1ULL << b->ports[j]))
+				vals.mask |= 1ULL << j;
+			if (set_bits & (1ULL << b->ports[j]))
+				vals.bits |= 1ULL << j;
+		}
+		if (vals.mask == 0)
+			continue;
+
+		if (ioctl(b->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &vals) < 0)
+			return -1; /* E_SYSFUNCERR */
+	}
+	return 0;
+}
+
+static int set_din_edge_flags(struct gpiochip_priv *p, uint64_t flags)
+{
+	struct gpio_v2_line_config cfg;
+	int k;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.flags = GPIO_V2_LINE_FLAG_INPUT | flags;
+	for (k = 0; k < p->din.num_of_banks; k++) {
+		if (ioctl(p->din.banks[k].fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &cfg) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void gpiochip_stop_events(struct dio_backend *be)
+{
+	set_din_edge_flags((struct gpiochip_priv *) be->priv, 0);
+}
+
+static int gpiochip_start_events(struct dio_backend *be)
+{
+	struct gpiochip_priv *p = (struct gpiochip_priv *) be->priv;
+	struct gpio_v2_line_event ev;
+	int k;
+
+	/* drop edges left over from an earlier run of the poll thread */
+	for (k = 0; k < p->din.num_of_banks; k++) {
+		while (read(p->din.banks[k].fd, &ev, sizeof(ev)) == sizeof(ev))
+			;
+	}
+
+	if (set_din_edge_flags(p, GPIO_V2_LINE_FLAG_EDGE_RISING |
+		GPIO_V2_LINE_FLAG_EDGE_FALLING) < 0) {
+		set_din_edge_flags(p, 0);
+		return -1;
+	}
+	return 0;
+}
+
+static int read_bank_edges(struct gpiochip_bank *b, struct din_edge *edges,
+	int max_edges)
+{
+	struct gpio_v2_line_event evs[16];
+	ssize_t len;
+	int n = 0, cnt, i, j;
+
+	while (n < max_edges) {
+		cnt = max_edges - n;
+		if (cnt > 16)
+			cnt = 16;
+
+		len = read(b->fd, evs, cnt * sizeof(struct gpio_v2_line_event));
+		if (len <= 0)
+			break;
+
+		for (i = 0; i < (int) (len / sizeof(struct gpio_v2_line_event)); i++) {
+			for (j = 0; j < b->num_of_lines; j++) {
+				if (b->offsets[j] == evs[i].offset)
+					break;
+			}
+			if (j == b->num_of_lines)
+				continue;
+
+			edges[n].diport = b->ports[j];
+			edges[n].state = (evs[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE) ?
+				DIO_STATE_HIGH : DIO_STATE_LOW;
+			edges[n].ts = evs[i].timestamp_ns;
+			n++;
+		}
+	}
+	return n;
+}
+
+static int gpiochip_wait_events(struct dio_backend *be, uint64_t watched,
+	uint64_t deadline, struct din_edge *edges, int max_edges, int *woken)
+{
+	struct gpiochip_priv *p = (struct gpiochip_priv *) be->priv;
+	struct pollfd fds[MAX_GPIOCHIP_BANKS + 1];
+	struct timespec timeout;
+	struct din_edge tmp;
+	uint64_t wake, now;
+	int ret, n = 0, k, i;
+
+	(void) watched;	/* edges of unwatched ports are dropped by the caller */
+	*woken = 0;
+
+	fds[0].fd = be->wake_fd;
+	fds[0].events = POLLIN;
+	for (k = 0; k < p->din.num_of_banks; k++) {
+		fds[k + 1].fd = p->din.banks[k].fd;
+		fds[k + 1].events = POLLIN;
+	}
+
+	if (deadline != UINT64_MAX) {
+		now = get_monotonic_ns();
+		ns_to_timespec((deadline > now) ? deadline - now : 0, &timeout);
+		ret = ppoll(fds, p->din.num_of_banks + 1, &timeout, NULL);
+	} else {
+		ret = ppoll(fds, p->din.num_of_banks + 1, NULL, NULL);
+	}
+	if (ret <= 0)
+		return ret;
+
+	if (fds[0].revents & POLLIN) {
+		if (read(be->wake_fd, &wake, sizeof(wake)) > 0)
+			*woken = 1;
+	}
+
+	for (k = 0; k < p->din.num_of_banks; k++) {
+		if (fds[k + 1].revents & POLLIN)
+			n += read_bank_edges(&p->din.banks[k], edges + n, max_edges - n);
+	}
+
+	/* merge the edges of several chips by their kernel timestamps */
+	for (i = 1; i < n; i++) {
+		tmp = edges[i];
+		for (k = i; k > 0 && edges[k - 1].ts > tmp.ts; k--)
+			edges[k] = edges[k - 1];
+		edges[k] = tmp;
+	}
+	return n;
+}
+
+const struct dio_backend_ops dio_backend_gpiochip = {
+	.name = "GPIOCHIP",
+	.caps = DIO_BACKEND_BULK_READ | DIO_BACKEND_BULK_WRITE | DIO_BACKEND_EDGE_EVENTS,
+	.init = gpiochip_init,
+	.close = gpiochip_close,
+	.read_din = gpiochip_read_din,
+	.read_dout = gpiochip_read_dout,
+	.write_dout = gpiochip_write_dout,
+	.read_din_bulk = gpiochip_read_din_bulk,
+	.write_dout_bulk = gpiochip_write_dout_bulk,
+	.start_events = gpiochip_start_events,
+	.wait_events = gpiochip_wait_events,
+	.stop_events = gpiochip_stop_events,
+};
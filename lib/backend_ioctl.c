@@ -0,0 +1,232 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Name:
+ *	MOXA DIO Library
+ *
+ * Description:
+ *	IOCTL backend: DIN/DOUT ports behind the ioctls of a Moxa DIO driver.
+ *
+ * Authors:
+ *	2006	Victor Yu	<victor.yu@moxa.com>
+ *	2018	Ken CJ Chou	<KenCJ.Chou@moxa.com>
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include "mx_dio_internal.h"
+
+enum ioctl_number {
+	IOCTL_SET_DOUT = 15,
+	IOCTL_GET_DOUT = 16,
+	IOCTL_GET_DIN = 17
+};
+
+struct dio_struct {
+	int port;
+	int data;
+};
+
+/*
+ * Device nodes stay open for the context's lifetime. The fd number of a
+ * node never changes once assigned: a reopen after a device error dup3()s
+ * the new file over the old fd, so concurrent callers never see a closed
+ * or recycled descriptor.
+ */
+struct dio_node_struct {
+	char path[MAX_FILEPATH_LEN];
+	int fd;
+};
+
+struct ioctl_priv {
+	pthread_mutex_t node_lock;
+	struct dio_node_struct *din_node;
+	struct dio_node_struct *dout_node;
+	struct dio_node_struct nodes[2];	/* DIO_NODE shares one entry */
+};
+
+static int load_node_path(struct json_object *conf, char *key, char *path)
+{
+	const char *node;
+
+	if (obj_get_str(conf, key, &node) < 0) {
+		if (obj_get_str(conf, "DIO_NODE", &node) < 0)
+			return -5; /* E_CONFERR */
+	}
+
+	if (strlen(node) >= MAX_FILEPATH_LEN)
+		return -5; /* E_CONFERR */
+
+	strcpy(path, node);
+	return 0;
+}
+
+static int node_get_fd(struct ioctl_priv *p, struct dio_node_struct *node)
+{
+	int fd;
+
+	fd = __atomic_load_n(&node->fd, __ATOMIC_ACQUIRE);
+	if (fd >= 0)
+		return fd;
+
+	pthread_mutex_lock(&p->node_lock);
+	if (node->fd < 0)
+		__atomic_store_n(&node->fd, open(node->path, O_RDWR | O_CLOEXEC),
+			__ATOMIC_RELEASE);
+	fd = node->fd;
+	pthread_mutex_unlock(&p->node_lock);
+
+	return fd;
+}
+
+static int node_reopen(struct ioctl_priv *p, struct dio_node_struct *node)
+{
+	int fd, ret = 0;
+
+	fd = open(node->path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	pthread_mutex_lock(&p->node_lock);
+	if (dup3(fd, node->fd, O_CLOEXEC) < 0)
+		ret = -1;
+	pthread_mutex_unlock(&p->node_lock);
+	close(fd);
+
+	return ret;
+}
+
+static int node_ioctl(struct ioctl_priv *p, struct dio_node_struct *node,
+	unsigned long request, struct dio_struct *dio)
+{
+	int fd;
+
+	fd = node_get_fd(p, node);
+	if (fd < 0)
+		return -1; /* E_SYSFUNCERR */
+
+	if (ioctl(fd, request, dio) == 0)
+		return 0;
+
+	/* the device went away underneath us: reopen it and retry once */
+	if (errno != ENODEV && errno != ENXIO && errno != EIO)
+		return -1; /* E_SYSFUNCERR */
+
+	if (node_reopen(p, node) < 0)
+		return -1; /* E_SYSFUNCERR */
+
+	if (ioctl(fd, request, dio) < 0)
+		return -1; /* E_SYSFUNCERR */
+	return 0;
+}
+
+static int ioctl_init(struct dio_backend *be, struct json_object *conf)
+{
+	struct ioctl_priv *p;
+	int ret;
+
+	p = (struct ioctl_priv *) calloc(1, sizeof(struct ioctl_priv));
+	if (p == NULL)
+		return -1; /* E_SYSFUNCERR */
+
+	p->nodes[0].fd = -1;
+	p->nodes[1].fd = -1;
+
+	if (be->num_of_din_ports > 0) {
+		p->din_node = &p->nodes[0];
+		ret = load_node_path(conf, "DIN_NODE", p->din_node->path);
+		if (ret < 0)
+			goto err;
+	}
+
+	if (be->num_of_dout_ports > 0) {
+		p->dout_node = &p->nodes[1];
+		ret = load_node_path(conf, "DOUT_NODE", p->dout_node->path);
+		if (ret < 0)
+			goto err;
+
+		if (p->din_node != NULL &&
+			strcmp(p->din_node->path, p->dout_node->path) == 0)
+			p->dout_node = p->din_node;
+	}
+
+	pthread_mutex_init(&p->node_lock, NULL);
+
+	/* a node that cannot be opened yet is retried on first use */
+	if (p->din_node != NULL)
+		node_get_fd(p, p->din_node);
+	if (p->dout_node != NULL)
+		node_get_fd(p, p->dout_node);
+
+	be->priv = p;
+	return 0;
+err:
+	free(p);
+	return ret;
+}
+
+static void ioctl_close(struct dio_backend *be)
+{
+	struct ioctl_priv *p = (struct ioctl_priv *) be->priv;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (p->nodes[i].fd >= 0)
+			close(p->nodes[i].fd);
+	}
+	pthread_mutex_destroy(&p->node_lock);
+	free(p);
+}
+
+static int ioctl_read_din(struct dio_backend *be, int diport, int *state)
+{
+	struct ioctl_priv *p = (struct ioctl_priv *) be->priv;
+	struct dio_struct din;
+
+	din.port = diport;
+	if (node_ioctl(p, p->din_node, IOCTL_GET_DIN, &din) < 0)
+		return -1; /* E_SYSFUNCERR */
+
+	*state = din.data;
+	return 0;
+}
+
+static int ioctl_read_dout(struct dio_backend *be, int doport, int *state)
+{
+	struct ioctl_priv *p = (struct ioctl_priv *) be->priv;
+	struct dio_struct dout;
+
+	dout.port = doport;
+	if (node_ioctl(p, p->dout_node, IOCTL_GET_DOUT, &dout) < 0)
+		return -1; /* E_SYSFUNCERR */
+
+	*state = dout.data;
+	return 0;
+}
+
+static int ioctl_write_dout(struct dio_backend *be, int doport, int state)
+{
+	struct ioctl_priv *p = (struct ioctl_priv *) be->priv;
+	struct dio_struct dout;
+
+	dout.port = doport;
+	dout.data = state;
+	return node_ioctl(p, p->dout_node, IOCTL_SET_DOUT, &dout);
+}
+
+/* the driver has one ioctl per port and no edge reporting */
+const struct dio_backend_ops dio_backend_ioctl = {
+	.name = "IOCTL",
+	.caps = 0,
+	.init = ioctl_init,
+	.close = ioctl_close,
+	.read_din = ioctl_read_din,
+	.read_dout = ioctl_read_dout,
+	.write_dout = ioctl_write_dout,
+};
@@ -0,0 +1,214 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Name:
+ *	MOXA DIO Library
+ *
+ * Description:
+ *	SIM backend: DIN/DOUT ports emulated in memory, so the library can be
+ *	run and benchmarked without a board.
+ */
+
+#include <stdlib.h>
+#include "mx_dio_internal.h"
+
+#define MAX_SIM_WAVE_STEPS 16
+
+/*
+ * A DIN port either plays a waveform, toggling its level at the end of
+ * each step starting from LOW, or follows the DOUT port of the same number
+ * when loopback is enabled.
+ */
+struct sim_wave_struct {
+	int num_of_steps;
+	uint64_t period;			/* in ns */
+	uint64_t ends[MAX_SIM_WAVE_STEPS];	/* step ends within period, in ns */
+};
+
+struct sim_priv {
+	int latency;		/* per device access, in us */
+	int loopback;
+	uint64_t dout;		/* DOUT levels, updated atomically */
+	uint64_t start;		/* waveform time base, CLOCK_MONOTONIC in ns */
+	struct sim_wave_struct wave[MAX_DIO_PORTS];
+};
+
+static int load_sim_waveforms(struct dio_backend *be, struct sim_priv *p,
+	struct json_object *conf)
+{
+	struct sim_wave_struct *wave;
+	struct array_list *waveforms, *steps;
+	int i, k, len;
+
+	if (obj_get_arr(conf, "SIM_DIN_WAVEFORMS", &waveforms) < 0)
+		return 0; /* optional */
+
+	if (waveforms == NULL || waveforms->length > (size_t) be->num_of_din_ports)
+		return -5; /* E_CONFERR */
+
+	for (i = 0; i < (int) waveforms->length; i++) {
+		wave = &p->wave[i];
+
+		if (arr_get_arr(waveforms, i, &steps) < 0)
+			return -5; /* E_CONFERR */
+		if (steps == NULL)
+			continue; /* null: no waveform on this port */
+
+		if (steps->length > MAX_SIM_WAVE_STEPS)
+			return -5; /* E_CONFERR */
+
+		for (k = 0; k < (int) steps->length; k++) {
+			if (arr_get_int(steps, k, &len) < 0 || len <= 0)
+				return -5; /* E_CONFERR */
+			wave->period += (uint64_t) len * 1000;
+			wave->ends[k] = wave->period;
+		}
+		wave->num_of_steps = steps->length;
+	}
+	return 0;
+}
+
+static int sim_init(struct dio_backend *be, struct json_object *conf)
+{
+	struct sim_priv *p;
+	int ret;
+
+	p = (struct sim_priv *) calloc(1, sizeof(struct sim_priv));
+	if (p == NULL)
+		return -1; /* E_SYSFUNCERR */
+
+	if (obj_get_int(conf, "SIM_ACCESS_LATENCY", &p->latency) < 0)
+		p->latency = 0;
+	if (p->latency < 0) {
+		free(p);
+		return -5; /* E_CONFERR */
+	}
+
+	if (obj_get_int(conf, "SIM_DIN_LOOPBACK", &p->loopback) < 0)
+		p->loopback = 0;
+
+	ret = load_sim_waveforms(be, p, conf);
+	if (ret < 0) {
+		free(p);
+		return ret;
+	}
+
+	p->start = get_monotonic_ns();
+	be->priv = p;
+	return 0;
+}
+
+static void sim_close(struct dio_backend *be)
+{
+	free(be->priv);
+}
+
+static void sim_access_delay(struct sim_priv *p)
+{
+	uint64_t end;
+
+	if (p->latency == 0)
+		return;
+
+	/* spin: sleeping cannot emulate microsecond device latencies */
+	end = get_monotonic_ns() + (uint64_t) p->latency * 1000;
+	while (get_monotonic_ns() < end)
+		;
+}
+
+static int sim_din_level(struct dio_backend *be, struct sim_priv *p, int diport,
+	uint64_t now)
+{
+	struct sim_wave_struct *wave = &p->wave[diport];
+	uint64_t offset;
+	int k;
+
+	if (wave->num_of_steps > 0) {
+		offset = (now - p->start) % wave->period;
+		for (k = 0; offset >= wave->ends[k]; k++)
+			;
+		return (k & 1) ? DIO_STATE_HIGH : DIO_STATE_LOW;
+	}
+
+	if (p->loopback && diport < be->num_of_dout_ports)
+		return (__atomic_load_n(&p->dout, __ATOMIC_RELAXED) >> diport) & 1;
+
+	return DIO_STATE_LOW;
+}
+
+static int sim_read_din(struct dio_backend *be, int diport, int *state)
+{
+	struct sim_priv *p = (struct sim_priv *) be->priv;
+
+	sim_access_delay(p);
+	*state = sim_din_level(be, p, diport, get_monotonic_ns());
+	return 0;
+}
+
+static int sim_read_dout(struct dio_backend *be, int doport, int *state)
+{
+	struct sim_priv *p = (struct sim_priv *) be->priv;
+
+	sim_access_delay(p);
+	*state = (__atomic_load_n(&p->dout, __ATOMIC_RELAXED) >> doport) & 1;
+	return 0;
+}
+
+static int sim_write_dout(struct dio_backend *be, int doport, int state)
+{
+	struct sim_priv *p = (struct sim_priv *) be->priv;
+
+	sim_access_delay(p);
+	if (state == DIO_STATE_HIGH)
+		__atomic_or_fetch(&p->dout, 1ULL << doport, __ATOMIC_RELAXED);
+	else
+		__atomic_and_fetch(&p->dout, ~(1ULL << doport), __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* a simulated bulk read: one access, all lines sampled at the same time */
+static uint64_t sim_read_din_bulk(struct dio_backend *be, uint64_t mask,
+	uint64_t *bitmap)
+{
+	struct sim_priv *p = (struct sim_priv *) be->priv;
+	uint64_t now, states = 0;
+	int diport;
+
+	sim_access_delay(p);
+	now = get_monotonic_ns();
+	for (diport = 0; diport < be->num_of_din_ports; diport++) {
+		if ((mask & (1ULL << diport)) &&
+			sim_din_level(be, p, diport, now) == DIO_STATE_HIGH)
+			states |= 1ULL << diport;
+	}
+
+	*bitmap = states;
+	return mask;
+}
+
+/* a simulated bulk write: one access, all lines switch together */
+static int sim_write_dout_bulk(struct dio_backend *be, uint64_t set_bits,
+	uint64_t clear_bits)
+{
+	struct sim_priv *p = (struct sim_priv *) be->priv;
+	uint64_t dout;
+
+	sim_access_delay(p);
+	dout = __atomic_load_n(&p->dout, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&p->dout, &dout,
+		(dout | set_bits) & ~clear_bits, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	return 0;
+}
+
+const struct dio_backend_ops dio_backend_sim = {
+	.name = "SIM",
+	.caps = DIO_BACKEND_BULK_READ | DIO_BACKEND_BULK_WRITE,
+	.init = sim_init,
+	.close = sim_close,
+	.read_din = sim_read_din,
+	.read_dout = sim_read_dout,
+	.write_dout = sim_write_dout,
+	.read_din_bulk = sim_read_din_bulk,
+	.write_dout_bulk = sim_write_dout_bulk,
+};
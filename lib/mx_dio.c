@@ -14,140 +14,300 @@
  *	2018	Ken CJ Chou	<KenCJ.Chou@moxa.com>
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include <pthread.h>
-#include <sys/time.h>
-#include <sys/file.h>
-#include <sys/ioctl.h>
+#include <sched.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <json-c/json.h>
-#include <moxa/mx_gpio.h>
 #include <mx_dio.h>
+#include "mx_dio_internal.h"
 
 #define CONF_FILE "/etc/moxa-configs/moxa-dio-control.json"
 #define CONF_VER_SUPPORTED "1.1.*"
 
-#define MAX_FILEPATH_LEN 256	/* reserved length for file path */
-#define DIN_INACCURACY 24000
+#define DEFAULT_DIN_POLLING_INTERVAL 100
+#define MAX_DISPATCH_THREADS 16
+#define DISPATCH_QUEUE_SIZE 256	/* per dispatcher thread, power of two */
+#define DEBOUNCE_COUNT_BITS 8
+#define MAX_DEBOUNCE_SAMPLES ((1 << DEBOUNCE_COUNT_BITS) - 1)
+#define STATS_SAMPLE_RATE 8	/* backend calls per timed call, power of two */
+#define DEFAULT_DIN_COUNTER_WINDOW 1000	/* in ms */
+#define DIN_COUNTER_BUCKETS 8
+#define DEFAULT_RECORDER_SIZE 65536	/* in records */
+#define MAX_RECORDER_SIZE (1 << 26)
+
+/* METHOD values of the config, see mx_dio_internal.h */
+static const struct dio_backend_ops *dio_backends[] = {
+	&dio_backend_ioctl,
+	&dio_backend_gpio,
+	&dio_backend_sim,
+#ifdef HAVE_GPIO_V2
+	&dio_backend_gpiochip,
+#endif
+};
 
-enum ioctl_number {
-	IOCTL_SET_DOUT = 15,
-	IOCTL_GET_DOUT = 16,
-	IOCTL_GET_DIN = 17
+/*
+ * Everything the hot path needs is resolved from the JSON config once per
+ * context, by load_config() in mx_dio_open(), so getting/setting a port is
+ * a bounds check plus an array lookup instead of a series of json-c hash
+ * lookups. What is specific to a METHOD lives in the private data of its
+ * backend.
+ */
+struct dio_port_struct {
+	int polling_interval;	/* DIN only, in us, atomic: set at run time */
+	int debounce_samples;	/* DIN only, 0 or 1 disables, atomic: set at run time */
 };
 
-struct dio_struct {
-	int port;
-	int data;
+struct dio_config_struct {
+	int num_of_din_ports;
+	int num_of_dout_ports;
+	int din_polling_interval;
+	int din_dispatch_threads;
+	uint64_t din_counter_window;	/* in ns, a multiple of DIN_COUNTER_BUCKETS */
+	struct mx_din_poll_thread_attr din_poll_attr;	/* requested */
+	char recorder_file[MAX_FILEPATH_LEN];	/* empty for no recorder */
+	int recorder_size;		/* in records */
+	struct dio_port_struct din_ports[MAX_DIO_PORTS];
+	struct dio_port_struct dout_ports[MAX_DIO_PORTS];
 };
 
 struct din_poll_thread_struct {
 	int flag;
+	int stop;
 	pthread_t thread;
 	pthread_mutex_t lock;
+	pthread_mutex_t start_lock;	/* serializes starting and stopping */
+	int wake_fd;	/* eventfd, kicked when an event is set or cleared */
+	int memory_locked;	/* under start_lock */
 };
 
-struct din_event_struct {
-	void (*func)(int diport);
-	int mode;
-	int last_state;
-	unsigned long duration;
-	int checking;
-	struct timeval start_time;
+/*
+ * Opt-in DIN event buffer. The DIN poll thread is the only producer and
+ * never blocks on it: when the buffer is full the record is dropped but
+ * its sequence number is still consumed, so readers see the overrun as a
+ * gap in seq. Readers are serialized by read_lock.
+ */
+struct din_event_ring_struct {
+	struct mx_din_event *buf;
+	uint64_t size;		/* power of two */
+	uint64_t head;		/* written by the producer only */
+	uint64_t tail;		/* written by readers only */
+	uint64_t seq;
+	pthread_mutex_t read_lock;
+	int event_fd;		/* eventfd for application event loops */
+	int armed;		/* set by readers, cleared when event_fd is kicked */
+	int pushed;		/* producer only: records pushed this cycle */
 };
 
-static int lib_initialized;
-static struct json_object *config;
-static struct din_poll_thread_struct din_poll_thread;
-static struct din_event_struct *din_event;
-
 /*
- * json-c utilities
+ * Callback of a DIN event: func for the context APIs, legacy_func for
+ * mx_din_set_event() on the default context. At most one is set.
  */
+struct din_event_callback {
+	void (*func)(struct mx_dio_ctx *ctx, int diport, void *arg);
+	void (*legacy_func)(int diport);
+	void *arg;
+};
 
-static inline int obj_get_obj(struct json_object *obj, char *key, struct json_object **val)
-{
-	if (!json_object_object_get_ex(obj, key, val))
-		return -1;
-	return 0;
-}
-
-static int obj_get_int(struct json_object *obj, char *key, int *val)
-{
-	struct json_object *tmp;
-
-	if (obj_get_obj(obj, key, &tmp) < 0)
-		return -1;
-
-	*val = json_object_get_int(tmp);
-	return 0;
-}
-
-static int obj_get_str(struct json_object *obj, char *key, const char **val)
-{
-	struct json_object *tmp;
-
-	if (obj_get_obj(obj, key, &tmp) < 0)
-		return -1;
-
-	*val = json_object_get_string(tmp);
-	return 0;
-}
+/*
+ * Callback dispatcher pool. When enabled, the DIN poll thread only queues
+ * fired events; callbacks run on the dispatcher threads without holding
+ * din_poll_thread.lock. A port always maps to the same dispatcher, so
+ * callbacks of one port run in order.
+ */
+struct din_dispatch_job {
+	struct din_event_callback cb;
+	int diport;
+	uint64_t detected;	/* CLOCK_MONOTONIC, in ns */
+};
 
-static int obj_get_arr(struct json_object *obj, char *key, struct array_list **val)
-{
-	struct json_object *tmp;
+struct din_dispatcher_struct {
+	struct mx_dio_ctx *ctx;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct din_dispatch_job jobs[DISPATCH_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	int stop;
+};
 
-	if (obj_get_obj(obj, key, &tmp) < 0)
-		return -1;
+struct din_dispatch_struct {
+	int num_of_threads;
+	struct din_dispatcher_struct *dispatchers;
+};
 
-	*val = json_object_get_array(tmp);
-	return 0;
-}
+/*
+ * Deadline scheduler of the DIN polling loop: a min-heap of the next read
+ * time of every watched port, so each cycle reads only the ports that are
+ * due. Owned by the DIN poll thread; reset is set atomically when polling
+ * intervals change.
+ */
+struct din_sched_entry {
+	uint64_t deadline;	/* CLOCK_MONOTONIC, in ns */
+	int diport;
+};
 
-static int arr_get_obj(struct array_list *arr, int idx, struct json_object **val)
-{
-	if (arr == NULL || idx >= arr->length)
-		return -1;
+struct din_sched_struct {
+	struct din_sched_entry heap[MAX_DIO_PORTS];
+	int len;
+	uint64_t mask;		/* ports in the heap */
+	int reset;		/* set atomically by applications */
+};
 
-	*val = array_list_get_idx(arr, idx);
-	return 0;
-}
+/*
+ * Bit-sliced DIN debounce filter. Bit N of every word belongs to DIN port N
+ * and the per-port counters are spread over the count[] planes, so
+ * filtering all ports is a fixed number of bitwise operations. A port
+ * takes a new level once it has read that level in limit consecutive
+ * samples. Owned by the DIN poll thread, which applies new limits of the
+ * ports in din_debounce_dirty at the start of a cycle.
+ */
+struct din_debounce_struct {
+	uint64_t level;				/* debounced levels */
+	uint64_t valid;				/* ports with a debounced level */
+	uint64_t bypass;			/* ports without a filter */
+	uint64_t count[DEBOUNCE_COUNT_BITS];
+	uint64_t limit[DEBOUNCE_COUNT_BITS];
+};
 
-static int arr_get_int(struct array_list *arr, int idx, int *val)
-{
-	struct json_object *tmp;
+struct din_event_struct {
+	struct din_event_callback cb;
+	int mode;
+	int last_state;
+	uint64_t duration;	/* in ns */
+	int checking;
+	uint64_t start_time;	/* CLOCK_MONOTONIC, in ns */
+};
 
-	if (arr_get_obj(arr, idx, &tmp) < 0)
-		return -1;
+/*
+ * Event registration of a DIN port as published by the applications.
+ * Writers update a slot under its sequence counter (odd while writing) and
+ * mark the port dirty; the DIN poll thread copies dirty slots into
+ * din_event at the start of each cycle. Registering an event therefore
+ * never waits for a scan or for device I/O.
+ */
+struct din_event_slot {
+	uint32_t seq;
+	struct din_event_callback cb;
+	int mode;
+	uint64_t duration;	/* in ns */
+};
 
-	*val = json_object_get_int(tmp);
-	return 0;
-}
+/*
+ * Pulse counter of a DIN port, updated by the DIN poll thread as it samples
+ * the port. Writers (the poll thread and resets) update it under its
+ * sequence counter (odd while writing) and readers copy it until they get
+ * a consistent snapshot, the same as event slots. Rising edges are also
+ * binned by time into DIN_COUNTER_BUCKETS buckets of a window each, so the
+ * edges of the last window are those of the buckets still inside it, and
+ * their first and last timestamps give the period.
+ */
+struct din_counter_bucket {
+	uint64_t idx;		/* ts / bucket length */
+	uint64_t count;
+	uint64_t first;		/* CLOCK_MONOTONIC, in ns */
+	uint64_t last;
+};
 
-static int arr_get_str(struct array_list *arr, int idx, const char **val)
-{
-	struct json_object *tmp;
+struct din_counter_struct {
+	uint32_t seq;
+	uint64_t rising;
+	uint64_t falling;
+	uint64_t last_edge;
+	struct din_counter_bucket buckets[DIN_COUNTER_BUCKETS];
+};
 
-	if (arr_get_obj(arr, idx, &tmp) < 0)
-		return -1;
+/*
+ * Write-through shadow of the DOUT levels. While it is enabled, every DOUT
+ * write of the library and every hardware read updates it under lock, and
+ * reads of valid ports are served from it. A failed write leaves its ports
+ * invalid until they are read again. Verification rereads the hardware to
+ * catch changes made behind the library.
+ */
+struct dout_shadow_struct {
+	int enabled;
+	uint64_t verify_interval;	/* in ns, 0 for none */
+	uint64_t next_verify;		/* CLOCK_MONOTONIC, in ns */
+	pthread_mutex_t lock;
+	uint64_t states;
+	uint64_t valid;
+};
 
-	*val = json_object_get_string(tmp);
-	return 0;
-}
+/*
+ * DOUT pulse engine. Every DOUT port can run one waveform: HIGH for width
+ * at the start of each period, for a number of pulses or until stopped.
+ * The engine thread sleeps until the earliest edge deadline (absolute,
+ * CLOCK_MONOTONIC) and writes the edges that are due together, with one
+ * bulk write when there are several. It holds lock while writing, so a
+ * waveform stopped by an application never has an edge written after the
+ * stop returns. active can be read without the lock.
+ */
+struct dout_wave_struct {
+	uint64_t period;	/* in ns, 0 for a single pulse */
+	uint64_t width;		/* in ns */
+	uint64_t remaining;	/* pulses left, UINT64_MAX for no limit */
+	uint64_t rise;		/* deadline of the current rising edge */
+	uint64_t next;		/* deadline of the next edge */
+	int level;		/* written by the next edge */
+	uint64_t risen;		/* when the last rising edge took effect */
+	struct mx_dout_pulse_stats stats;
+};
 
-static int arr_get_arr(struct array_list *arr, int idx, struct array_list **val)
-{
-	struct json_object *tmp;
+struct dout_wave_thread_struct {
+	int flag;
+	int stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* CLOCK_MONOTONIC, signaled on changes */
+	uint64_t active;	/* ports running a waveform */
+	struct dout_wave_struct ports[MAX_DIO_PORTS];
+};
 
-	if (arr_get_obj(arr, idx, &tmp) < 0)
-		return -1;
+/*
+ * Everything a board configuration needs lives in its context, so
+ * independent contexts can be used from different threads at the same
+ * time. The legacy APIs work on a default context created by
+ * mx_dio_init().
+ */
+struct mx_dio_ctx {
+	struct dio_config_struct config;
+	struct dio_backend backend;
+	pthread_mutex_t dout_multi_lock;
+	struct dout_shadow_struct dout_shadow;
+	struct dout_wave_thread_struct dout_wave;
+	struct din_poll_thread_struct din_poll_thread;
+	struct din_event_struct din_event[MAX_DIO_PORTS];	/* poll thread only */
+	struct din_event_slot din_event_slot[MAX_DIO_PORTS];
+	uint64_t din_event_dirty;	/* ports with an unapplied slot */
+	struct din_event_ring_struct din_event_ring;
+	struct din_dispatch_struct *din_dispatch;
+	struct mx_din_dispatch_stats din_dispatch_stats;
+	struct din_sched_struct din_sched;
+	struct din_debounce_struct din_debounce;
+	struct mx_din_poll_timing din_poll_timing;
+	struct mx_dio_stats stats;	/* updated with relaxed atomics */
+	uint64_t din_debounce_dirty;	/* ports with an unapplied filter */
+	uint64_t din_counting;		/* counted ports, updated atomically */
+	struct din_counter_struct din_counter[MAX_DIO_PORTS];
+	uint64_t din_states;		/* last sampled DIN levels */
+	uint64_t din_states_valid;	/* ports with a valid din_states bit */
+	struct dio_recorder *recorder;	/* set for the life of the context */
+	uint64_t recorder_douts;	/* last recorded DOUT levels */
+	uint64_t recorder_douts_valid;
+};
 
-	*val = json_object_get_array(tmp);
-	return 0;
-}
+static struct mx_dio_ctx *default_ctx;
+static pthread_mutex_t default_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * static functions
@@ -168,419 +328,2883 @@ static int check_config_version_supported(const char *conf_ver)
 	return 0;
 }
 
-static int init_din_event_array(void)
+static int load_din_polling_intervals(struct mx_dio_ctx *ctx, struct json_object *conf)
 {
-	int num_of_din_ports, i;
+	struct array_list *intervals;
+	int i;
 
-	if (obj_get_int(config, "NUM_OF_DIN_PORTS", &num_of_din_ports) < 0)
-		return -5; /* E_CONFERR */
+	for (i = 0; i < ctx->config.num_of_din_ports; i++)
+		ctx->config.din_ports[i].polling_interval = ctx->config.din_polling_interval;
 
-	din_event = (struct din_event_struct *)
-		malloc(num_of_din_ports * sizeof(struct din_event_struct));
-	if (din_event == NULL)
-		return -1; /* E_SYSFUNCERR */
+	if (obj_get_arr(conf, "DIN_PORT_POLLING_INTERVALS", &intervals) < 0)
+		return 0; /* optional */
+
+	for (i = 0; i < ctx->config.num_of_din_ports; i++) {
+		if (arr_get_int(intervals, i, &ctx->config.din_ports[i].polling_interval) < 0)
+			return -5; /* E_CONFERR */
 
-	for (i = 0; i < num_of_din_ports; i++) {
-		din_event[i].func = NULL;
-		din_event[i].mode = DIN_EVENT_CLEAR;
-		din_event[i].checking = 0;
+		if (ctx->config.din_ports[i].polling_interval <= 0)
+			return -5; /* E_CONFERR */
 	}
 	return 0;
 }
 
-static int set_dout_state_ioctl(int doport, int state)
+static int load_din_debounce_samples(struct mx_dio_ctx *ctx, struct json_object *conf)
 {
-	struct dio_struct dout;
-	const char *dout_node;
-	int fd;
+	struct array_list *samples;
+	int i;
+
+	for (i = 0; i < ctx->config.num_of_din_ports; i++)
+		ctx->config.din_ports[i].debounce_samples = 0;
+
+	if (obj_get_arr(conf, "DIN_DEBOUNCE_SAMPLES", &samples) < 0)
+		return 0; /* optional */
+
+	for (i = 0; i < ctx->config.num_of_din_ports; i++) {
+		if (arr_get_int(samples, i, &ctx->config.din_ports[i].debounce_samples) < 0)
+			return -5; /* E_CONFERR */
 
-	if (obj_get_str(config, "DOUT_NODE", &dout_node) < 0) {
-		if (obj_get_str(config, "DIO_NODE", &dout_node) < 0)
+		if (ctx->config.din_ports[i].debounce_samples < 0 ||
+			ctx->config.din_ports[i].debounce_samples > MAX_DEBOUNCE_SAMPLES)
 			return -5; /* E_CONFERR */
 	}
+	return 0;
+}
 
-	fd = open(dout_node, O_RDWR);
-	if (fd < 0)
-		return -1; /* E_SYSFUNCERR */
+static const struct {
+	const char *name;
+	int policy;
+} sched_policies[] = {
+	{ "SCHED_OTHER", SCHED_OTHER },
+	{ "SCHED_FIFO", SCHED_FIFO },
+	{ "SCHED_RR", SCHED_RR },
+};
 
-	dout.port = doport;
-	dout.data = state;
-	if (ioctl(fd, IOCTL_SET_DOUT, &dout) < 0) {
-		close(fd);
-		return -1; /* E_SYSFUNCERR */
+static int check_din_poll_thread_attr(const struct mx_din_poll_thread_attr *attr)
+{
+	if (attr->policy == SCHED_OTHER) {
+		if (attr->priority != 0)
+			return -1;
+	} else if (attr->policy == SCHED_FIFO || attr->policy == SCHED_RR) {
+		if (attr->priority < sched_get_priority_min(attr->policy) ||
+			attr->priority > sched_get_priority_max(attr->policy))
+			return -1;
+	} else {
+		return -1;
 	}
-	close(fd);
 
+	if (attr->stack_size != 0 && attr->stack_size < (size_t) PTHREAD_STACK_MIN)
+		return -1;
+	if (attr->lock_memory != 0 && attr->lock_memory != 1)
+		return -1;
 	return 0;
 }
 
-static int get_dout_state_ioctl(int doport, int *state)
+static int load_din_poll_thread_attr(struct mx_dio_ctx *ctx, struct json_object *conf)
 {
-	struct dio_struct dout;
-	const char *dout_node;
-	int fd;
-
-	if (obj_get_str(config, "DOUT_NODE", &dout_node) < 0) {
-		if (obj_get_str(config, "DIO_NODE", &dout_node) < 0)
+	struct mx_din_poll_thread_attr *attr = &ctx->config.din_poll_attr;
+	struct array_list *cpus;
+	const char *policy;
+	int i, cpu, stack_size;
+
+	memset(attr, 0, sizeof(struct mx_din_poll_thread_attr));
+	attr->policy = SCHED_OTHER;
+
+	if (obj_get_str(conf, "DIN_POLL_THREAD_POLICY", &policy) == 0) {
+		for (i = 0; i < (int) (sizeof(sched_policies) / sizeof(sched_policies[0])); i++) {
+			if (policy != NULL && strcmp(policy, sched_policies[i].name) == 0)
+				break;
+		}
+		if (i == (int) (sizeof(sched_policies) / sizeof(sched_policies[0])))
 			return -5; /* E_CONFERR */
+		attr->policy = sched_policies[i].policy;
 	}
 
-	fd = open(dout_node, O_RDWR);
-	if (fd < 0)
-		return -1; /* E_SYSFUNCERR */
+	if (obj_get_int(conf, "DIN_POLL_THREAD_PRIORITY", &attr->priority) < 0)
+		attr->priority = 0;
 
-	dout.port = doport;
-	if (ioctl(fd, IOCTL_GET_DOUT, &dout) < 0) {
-		close(fd);
-		return -1; /* E_SYSFUNCERR */
+	if (obj_get_arr(conf, "DIN_POLL_THREAD_CPUS", &cpus) == 0) {
+		if (cpus == NULL)
+			return -5; /* E_CONFERR */
+		for (i = 0; i < (int) cpus->length; i++) {
+			if (arr_get_int(cpus, i, &cpu) < 0 || cpu < 0 || cpu >= 64)
+				return -5; /* E_CONFERR */
+			attr->cpus |= 1ULL << cpu;
+		}
 	}
-	close(fd);
-
-	*state = dout.data;
-	return 0;
-}
-
-static int get_din_state_ioctl(int diport, int *state)
-{
-	struct dio_struct din;
-	const char *din_node;
-	int fd;
 
-	if (obj_get_str(config, "DIN_NODE", &din_node) < 0) {
-		if (obj_get_str(config, "DIO_NODE", &din_node) < 0)
+	if (obj_get_int(conf, "DIN_POLL_THREAD_STACK_SIZE", &stack_size) == 0) {
+		if (stack_size < 0)
 			return -5; /* E_CONFERR */
+		attr->stack_size = stack_size;
 	}
 
-	fd = open(din_node, O_RDWR);
-	if (fd < 0)
-		return -1; /* E_SYSFUNCERR */
-
-	din.port = diport;
-	if (ioctl(fd, IOCTL_GET_DIN, &din) < 0) {
-		close(fd);
-		return -1; /* E_SYSFUNCERR */
-	}
-	close(fd);
+	if (obj_get_int(conf, "LOCK_MEMORY", &attr->lock_memory) < 0)
+		attr->lock_memory = 0;
 
-	*state = din.data;
+	if (check_din_poll_thread_attr(attr) < 0)
+		return -5; /* E_CONFERR */
 	return 0;
 }
 
-static int set_dout_state_gpio(int doport, int state)
+static int load_config(struct mx_dio_ctx *ctx, struct json_object *conf)
 {
-	struct array_list *gpio_nums_of_doports;
-	int ret, gpio_num;
+	const char *method, *recorder_file;
+	int ret, i, verify_interval, counter_window;
 
-	if (obj_get_arr(config, "GPIO_NUMS_OF_DOUT_PORTS", &gpio_nums_of_doports) < 0)
+	if (obj_get_int(conf, "NUM_OF_DIN_PORTS", &ctx->config.num_of_din_ports) < 0)
 		return -5; /* E_CONFERR */
 
-	if (arr_get_int(gpio_nums_of_doports, doport, &gpio_num) < 0)
+	if (obj_get_int(conf, "NUM_OF_DOUT_PORTS", &ctx->config.num_of_dout_ports) < 0)
 		return -5; /* E_CONFERR */
 
-	if (state == DIO_STATE_LOW) {
-		ret = mx_gpio_set_value(gpio_num, GPIO_VALUE_LOW);
-		if (ret < 0)
-			return ret;
-	} else if (state == DIO_STATE_HIGH) {
-		ret = mx_gpio_set_value(gpio_num, GPIO_VALUE_HIGH);
-		if (ret < 0)
-			return ret;
-	}
-
-	return 0;
-}
-
-static int get_dout_state_gpio(int doport, int *state)
-{
-	struct array_list *gpio_nums_of_doports;
-	int ret, gpio_num;
-
-	if (obj_get_arr(config, "GPIO_NUMS_OF_DOUT_PORTS", &gpio_nums_of_doports) < 0)
+	if (ctx->config.num_of_din_ports < 0 || ctx->config.num_of_din_ports > MAX_DIO_PORTS ||
+		ctx->config.num_of_dout_ports < 0 || ctx->config.num_of_dout_ports > MAX_DIO_PORTS)
 		return -5; /* E_CONFERR */
 
-	if (arr_get_int(gpio_nums_of_doports, doport, &gpio_num) < 0)
+	if (obj_get_int(conf, "DIN_PORT_POLLING_INTERVAL",
+		&ctx->config.din_polling_interval) < 0)
+		ctx->config.din_polling_interval = DEFAULT_DIN_POLLING_INTERVAL;
+
+	if (ctx->config.din_polling_interval <= 0)
 		return -5; /* E_CONFERR */
 
-	ret = mx_gpio_get_value(gpio_num, state);
+	ret = load_din_polling_intervals(ctx, conf);
 	if (ret < 0)
 		return ret;
 
-	return 0;
-}
-
-static int get_din_state_gpio(int diport, int *state)
-{
-	struct array_list *gpio_nums_of_diports;
-	int ret, gpio_num;
+	ret = load_din_debounce_samples(ctx, conf);
+	if (ret < 0)
+		return ret;
 
-	if (obj_get_arr(config, "GPIO_NUMS_OF_DIN_PORTS", &gpio_nums_of_diports) < 0)
-		return -5; /* E_CONFERR */
+	if (obj_get_int(conf, "DIN_EVENT_DISPATCH_THREADS",
+		&ctx->config.din_dispatch_threads) < 0)
+		ctx->config.din_dispatch_threads = 0;
 
-	if (arr_get_int(gpio_nums_of_diports, diport, &gpio_num) < 0)
+	if (ctx->config.din_dispatch_threads < 0 ||
+		ctx->config.din_dispatch_threads > MAX_DISPATCH_THREADS)
 		return -5; /* E_CONFERR */
 
-	ret = mx_gpio_get_value(gpio_num, state);
+	ret = load_din_poll_thread_attr(ctx, conf);
 	if (ret < 0)
 		return ret;
 
-	return 0;
-}
-
-static unsigned long count_timeval_diff(struct timeval t1, struct timeval t2)
-{
-	unsigned long diff = 0;
-
-	diff += 1000000 * (unsigned long) (t2.tv_sec - t1.tv_sec);
-	diff += t2.tv_usec - t1.tv_usec;
-	return diff;
-}
-
-static void check_event(int diport)
-{
-	struct din_event_struct *ev;
-	int state;
-	struct timeval tv;
-
-	ev = &din_event[diport];
+	if (obj_get_int(conf, "DIN_COUNTER_WINDOW", &counter_window) < 0)
+		counter_window = DEFAULT_DIN_COUNTER_WINDOW;
+	if (counter_window <= 0)
+		return -5; /* E_CONFERR */
+	ctx->config.din_counter_window = (uint64_t) counter_window * 1000000;
+
+	if (obj_get_int(conf, "DOUT_SHADOW", &ctx->dout_shadow.enabled) < 0)
+		ctx->dout_shadow.enabled = 0;
+	if (obj_get_int(conf, "DOUT_SHADOW_VERIFY_INTERVAL", &verify_interval) < 0)
+		verify_interval = 0;
+	if ((ctx->dout_shadow.enabled != 0 && ctx->dout_shadow.enabled != 1) ||
+		verify_interval < 0)
+		return -5; /* E_CONFERR */
+	ctx->dout_shadow.verify_interval = (uint64_t) verify_interval * 1000000;
 
-	if (ev->func == NULL ||
-		ev->mode == DIN_EVENT_CLEAR)
-		return;
+	if (obj_get_str(conf, "RECORDER_FILE", &recorder_file) == 0) {
+		if (recorder_file == NULL || strlen(recorder_file) >= MAX_FILEPATH_LEN)
+			return -5; /* E_CONFERR */
+		strcpy(ctx->config.recorder_file, recorder_file);
+	}
+	if (obj_get_int(conf, "RECORDER_SIZE", &ctx->config.recorder_size) < 0)
+		ctx->config.recorder_size = DEFAULT_RECORDER_SIZE;
+	if (ctx->config.recorder_size <= 0 || ctx->config.recorder_size > MAX_RECORDER_SIZE)
+		return -5; /* E_CONFERR */
 
-	if (mx_din_get_state(diport, &state) < 0)
-		return;
+	if (obj_get_str(conf, "METHOD", &method) < 0)
+		return -5; /* E_CONFERR */
 
-	if (ev->duration == 0) {
-		if (state != ev->last_state) {
-			if ((ev->mode == DIN_EVENT_HIGH_TO_LOW && state == DIO_STATE_LOW) ||
-				(ev->mode == DIN_EVENT_LOW_TO_HIGH && state == DIO_STATE_HIGH) ||
-				(ev->mode == DIN_EVENT_STATE_CHANGE)) {
-				ev->func(diport);
-			}
-			ev->last_state = state;
-		}
-	} else {
-		if (state != ev->last_state) {
-			if ((ev->mode == DIN_EVENT_LOW_TO_HIGH && state == DIO_STATE_HIGH) ||
-				(ev->mode == DIN_EVENT_HIGH_TO_LOW && state == DIO_STATE_LOW) ||
-				(ev->mode == DIN_EVENT_STATE_CHANGE)) {
-				gettimeofday(&ev->start_time, NULL);
-				ev->checking = 1;
-			} else if ((ev->mode == DIN_EVENT_HIGH_TO_LOW && state == DIO_STATE_HIGH) ||
-				(ev->mode == DIN_EVENT_LOW_TO_HIGH && state == DIO_STATE_LOW)) {
-				ev->checking = 0;
-			}
-			ev->last_state = state;
-		} else if (ev->checking == 1) {
-			gettimeofday(&tv, NULL);
-			if ((count_timeval_diff(ev->start_time, tv)
-				+ DIN_INACCURACY) >= ev->duration) {
-				ev->func(diport);
-				ev->checking = 0;
-			}
-		}
+	for (i = 0; i < (int) (sizeof(dio_backends) / sizeof(dio_backends[0])); i++) {
+		if (strcmp(method, dio_backends[i]->name) == 0)
+			break;
 	}
+	if (i == (int) (sizeof(dio_backends) / sizeof(dio_backends[0])))
+		return -5; /* E_CONFERR */
+
+	ctx->backend.ops = dio_backends[i];
+	ctx->backend.num_of_din_ports = ctx->config.num_of_din_ports;
+	ctx->backend.num_of_dout_ports = ctx->config.num_of_dout_ports;
+	ctx->backend.wake_fd = -1;
+	return ctx->backend.ops->init(&ctx->backend, conf);
 }
 
-static void *din_poll(void *arg)
+static void init_din_event_array(struct mx_dio_ctx *ctx)
 {
-	int num_of_din_ports, polling_interval;
 	int i;
 
-	obj_get_int(config, "NUM_OF_DIN_PORTS", &num_of_din_ports);
-	obj_get_int(config, "DIN_PORT_POLLING_INTERVAL", &polling_interval);
-
-	while (1) {
-		pthread_mutex_lock(&din_poll_thread.lock);
-		for (i = 0; i < num_of_din_ports; i++)
-			check_event(i);
-		pthread_mutex_unlock(&din_poll_thread.lock);
-		usleep(polling_interval);
+	for (i = 0; i < ctx->config.num_of_din_ports; i++) {
+		memset(&ctx->din_event[i].cb, 0, sizeof(struct din_event_callback));
+		ctx->din_event[i].mode = DIN_EVENT_CLEAR;
+		ctx->din_event[i].checking = 0;
+		ctx->din_event_slot[i].mode = DIN_EVENT_CLEAR;
 	}
-
-	din_poll_thread.flag = 0;
-	return NULL;
 }
 
 /*
- * APIs
+ * Statistics
  */
 
-int mx_dio_init(void)
+static inline void atomic_max_u64(uint64_t *p, uint64_t val)
 {
-	int ret;
-	const char *conf_ver;
+	uint64_t max = __atomic_load_n(p, __ATOMIC_RELAXED);
 
-	if (lib_initialized)
-		return 0;
+	while (val > max && !__atomic_compare_exchange_n(p, &max, val, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
 
-	config = json_object_from_file(CONF_FILE);
-	if (config == NULL)
-		return -5; /* E_CONFERR */
+static void hist_record(struct mx_dio_hist *h, uint64_t ns)
+{
+	int b = (ns > 1) ? 63 - __builtin_clzll(ns) : 0;
 
-	if (obj_get_str(config, "CONFIG_VERSION", &conf_ver) < 0)
-		return -5; /* E_CONFERR */
+	if (b >= MX_DIO_HIST_BUCKETS)
+		b = MX_DIO_HIST_BUCKETS - 1;
 
-	ret = check_config_version_supported(conf_ver);
-	if (ret < 0)
-		return ret;
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->total, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->buckets[b], 1, __ATOMIC_RELAXED);
+	atomic_max_u64(&h->max, ns);
+}
 
-	din_poll_thread.flag = 0;
-	ret = init_din_event_array();
-	if (ret < 0)
-		return ret;
+/*
+ * Backend calls are counted exactly, but only one in STATS_SAMPLE_RATE is
+ * timed: reading the clock twice costs more than a cached GPIO read.
+ * Returns the start time, or 0 if this call is not sampled.
+ */
+static inline uint64_t op_stats_begin(struct mx_dio_op_stats *op)
+{
+	uint64_t n = __atomic_fetch_add(&op->calls, 1, __ATOMIC_RELAXED);
 
-	lib_initialized = 1;
-	return 0;
+	return (n & (STATS_SAMPLE_RATE - 1)) ? 0 : get_monotonic_ns();
 }
 
-int mx_dout_set_state(int doport, int state)
+static inline void op_stats_end(struct mx_dio_op_stats *op, uint64_t start, int ret)
 {
-	const char *method;
-	int num_of_dout_ports;
+	if (ret < 0)
+		__atomic_add_fetch(&op->errors, 1, __ATOMIC_RELAXED);
+	if (start != 0)
+		hist_record(&op->latency, get_monotonic_ns() - start);
+}
 
-	if (!lib_initialized)
-		return -3; /* E_LIBNOTINIT */
+static void event_stats_record(struct mx_dio_ctx *ctx, int diport, uint64_t detected)
+{
+	struct mx_dio_event_stats *ev = &ctx->stats.event_latency[diport];
+	uint64_t ns = get_monotonic_ns() - detected;
 
-	if (obj_get_int(config, "NUM_OF_DOUT_PORTS", &num_of_dout_ports) < 0)
-		return -5; /* E_CONFERR */
+	__atomic_add_fetch(&ev->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ev->total, ns, __ATOMIC_RELAXED);
+	atomic_max_u64(&ev->max, ns);
+	hist_record(&ctx->stats.event_latency_all, ns);
+}
 
-	if (doport < 0 || doport >= num_of_dout_ports)
-		return -2; /* E_INVAL */
+static int get_din_state(struct mx_dio_ctx *ctx, int diport, int *state)
+{
+	uint64_t start = op_stats_begin(&ctx->stats.din_read);
+	int ret;
 
-	if (state != DIO_STATE_LOW && state != DIO_STATE_HIGH)
-		return -2; /* E_INVAL */
+	ret = ctx->backend.ops->read_din(&ctx->backend, diport, state);
 
-	if (obj_get_str(config, "METHOD", &method) < 0)
-		return -5; /* E_CONFERR */
+	op_stats_end(&ctx->stats.din_read, start, ret);
+	return ret;
+}
+
+static int read_dout_hw(struct mx_dio_ctx *ctx, int doport, int *state)
+{
+	uint64_t start = op_stats_begin(&ctx->stats.dout_read);
+	int ret;
 
-	if (strcmp(method, "IOCTL") == 0)
-		return set_dout_state_ioctl(doport, state);
-	else if (strcmp(method, "GPIO") == 0)
-		return set_dout_state_gpio(doport, state);
+	ret = ctx->backend.ops->read_dout(&ctx->backend, doport, state);
 
-	return -5; /* E_CONFERR */
+	op_stats_end(&ctx->stats.dout_read, start, ret);
+	return ret;
 }
 
-int mx_dout_get_state(int doport, int *state)
+/* called with dout_shadow.lock held */
+static void dout_shadow_store(struct mx_dio_ctx *ctx, uint64_t set_bits,
+	uint64_t clear_bits, int ret)
 {
-	const char *method;
-	int num_of_dout_ports;
+	struct dout_shadow_struct *sh = &ctx->dout_shadow;
 
-	if (!lib_initialized)
-		return -3; /* E_LIBNOTINIT */
+	if (ret < 0) {
+		sh->valid &= ~(set_bits | clear_bits);
+		return;
+	}
+	sh->states = (sh->states | set_bits) & ~clear_bits;
+	sh->valid |= set_bits | clear_bits;
+}
 
-	if (obj_get_int(config, "NUM_OF_DOUT_PORTS", &num_of_dout_ports) < 0)
-		return -5; /* E_CONFERR */
+static int get_dout_state(struct mx_dio_ctx *ctx, int doport, int *state)
+{
+	struct dout_shadow_struct *sh = &ctx->dout_shadow;
+	uint64_t bit = 1ULL << doport;
+	int ret;
 
-	if (doport < 0 || doport >= num_of_dout_ports)
-		return -2; /* E_INVAL */
+	if (!__atomic_load_n(&sh->enabled, __ATOMIC_ACQUIRE))
+		return read_dout_hw(ctx, doport, state);
 
-	if (obj_get_str(config, "METHOD", &method) < 0)
-		return -5; /* E_CONFERR */
+	pthread_mutex_lock(&sh->lock);
+	if (sh->valid & bit) {
+		*state = (sh->states & bit) ? DIO_STATE_HIGH : DIO_STATE_LOW;
+		pthread_mutex_unlock(&sh->lock);
+		__atomic_add_fetch(&ctx->stats.dout_cached_reads, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
 
-	if (strcmp(method, "IOCTL") == 0)
-		return get_dout_state_ioctl(doport, state);
-	else if (strcmp(method, "GPIO") == 0)
-		return get_dout_state_gpio(doport, state);
+	ret = read_dout_hw(ctx, doport, state);
+	if (ret == 0)
+		dout_shadow_store(ctx, (*state == DIO_STATE_HIGH) ? bit : 0,
+			(*state == DIO_STATE_HIGH) ? 0 : bit, 0);
+	pthread_mutex_unlock(&sh->lock);
 
-	return -5; /* E_CONFERR */
+	return ret;
 }
 
-int mx_din_get_state(int diport, int *state)
+static int write_dout_hw(struct mx_dio_ctx *ctx, int doport, int state)
 {
-	const char *method;
-	int num_of_din_ports;
+	uint64_t start = op_stats_begin(&ctx->stats.dout_write);
+	int ret;
 
-	if (!lib_initialized)
-		return -3; /* E_LIBNOTINIT */
+	ret = ctx->backend.ops->write_dout(&ctx->backend, doport, state);
 
-	if (obj_get_int(config, "NUM_OF_DIN_PORTS", &num_of_din_ports) < 0)
-		return -5; /* E_CONFERR */
+	op_stats_end(&ctx->stats.dout_write, start, ret);
+	return ret;
+}
+
+/*
+ * Record the DOUT ports just written. Their old levels are the ones last
+ * recorded, which are unknown until the library has written a port once.
+ */
+static void record_dout(struct mx_dio_ctx *ctx, uint64_t set_bits,
+	uint64_t clear_bits, int source)
+{
+	uint64_t ts = get_monotonic_ns();
+	uint64_t bits = set_bits | clear_bits;
+	uint64_t old, new, valid, bit;
+	int doport;
+
+	old = __atomic_load_n(&ctx->recorder_douts, __ATOMIC_RELAXED);
+	do {
+		new = (old | set_bits) & ~clear_bits;
+	} while (!__atomic_compare_exchange_n(&ctx->recorder_douts, &old, new, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	valid = __atomic_fetch_or(&ctx->recorder_douts_valid, bits, __ATOMIC_RELAXED);
+
+	for (; bits; bits &= bits - 1) {
+		doport = __builtin_ctzll(bits);
+		bit = 1ULL << doport;
+		dio_recorder_add(ctx->recorder, ts, doport, DIO_RECORD_DOUT,
+			!(valid & bit) ? DIO_RECORD_STATE_UNKNOWN :
+			(old & bit) ? DIO_STATE_HIGH : DIO_STATE_LOW,
+			(set_bits & bit) ? DIO_STATE_HIGH : DIO_STATE_LOW, source);
+	}
+}
+
+/* source is the DIO_RECORD_SRC_xxx of the write */
+static int set_dout_state(struct mx_dio_ctx *ctx, int doport, int state, int source)
+{
+	struct dout_shadow_struct *sh = &ctx->dout_shadow;
+	uint64_t bit = 1ULL << doport;
+	int ret;
+
+	if (!__atomic_load_n(&sh->enabled, __ATOMIC_ACQUIRE)) {
+		ret = write_dout_hw(ctx, doport, state);
+	} else {
+		pthread_mutex_lock(&sh->lock);
+		ret = write_dout_hw(ctx, doport, state);
+		dout_shadow_store(ctx, (state == DIO_STATE_HIGH) ? bit : 0,
+			(state == DIO_STATE_HIGH) ? 0 : bit, ret);
+		pthread_mutex_unlock(&sh->lock);
+	}
+
+	if (ret == 0 && ctx->recorder != NULL)
+		record_dout(ctx, (state == DIO_STATE_HIGH) ? bit : 0,
+			(state == DIO_STATE_HIGH) ? 0 : bit, source);
+	return ret;
+}
+
+/* one bulk write if the backend has it, one write per port otherwise */
+static int write_dout_multi_hw(struct mx_dio_ctx *ctx, uint64_t set_bits,
+	uint64_t clear_bits)
+{
+	struct dio_backend *be = &ctx->backend;
+	uint64_t start = op_stats_begin(&ctx->stats.dout_write);
+	int ret = 0, doport;
+
+	if (be->ops->caps & DIO_BACKEND_BULK_WRITE) {
+		ret = be->ops->write_dout_bulk(be, set_bits, clear_bits);
+	} else {
+		for (doport = 0; doport < ctx->config.num_of_dout_ports; doport++) {
+			if (!((set_bits | clear_bits) & (1ULL << doport)))
+				continue;
+
+			ret = be->ops->write_dout(be, doport, (set_bits & (1ULL << doport)) ?
+				DIO_STATE_HIGH : DIO_STATE_LOW);
+			if (ret < 0)
+				break;
+		}
+	}
+
+	op_stats_end(&ctx->stats.dout_write, start, ret);
+	return ret;
+}
+
+static int set_dout_multi_state(struct mx_dio_ctx *ctx, uint64_t set_bits,
+	uint64_t clear_bits, int source)
+{
+	struct dout_shadow_struct *sh = &ctx->dout_shadow;
+	int ret;
+
+	if (!__atomic_load_n(&sh->enabled, __ATOMIC_ACQUIRE)) {
+		ret = write_dout_multi_hw(ctx, set_bits, clear_bits);
+	} else {
+		pthread_mutex_lock(&sh->lock);
+		ret = write_dout_multi_hw(ctx, set_bits, clear_bits);
+		dout_shadow_store(ctx, set_bits, clear_bits, ret);
+		pthread_mutex_unlock(&sh->lock);
+	}
+
+	if (ret == 0 && ctx->recorder != NULL)
+		record_dout(ctx, set_bits, clear_bits, source);
+	return ret;
+}
+
+/*
+ * Reread every DOUT port from the hardware into the shadow and count the
+ * valid ports that had changed. Each port is read under the lock, so DOUT
+ * writes wait for one read at most. Returns the changed ports.
+ */
+static uint64_t dout_shadow_verify(struct mx_dio_ctx *ctx, int *ret)
+{
+	struct dout_shadow_struct *sh = &ctx->dout_shadow;
+	uint64_t bit, mismatched = 0;
+	int doport, state;
+
+	*ret = 0;
+	for (doport = 0; doport < ctx->config.num_of_dout_ports; doport++) {
+		bit = 1ULL << doport;
+		pthread_mutex_lock(&sh->lock);
+		if (read_dout_hw(ctx, doport, &state) < 0) {
+			sh->valid &= ~bit;
+			pthread_mutex_unlock(&sh->lock);
+			*ret = -1; /* E_SYSFUNCERR */
+			continue;
+		}
+		if ((sh->valid & bit) && ((sh->states & bit) != 0) != (state == DIO_STATE_HIGH))
+			mismatched |= bit;
+		dout_shadow_store(ctx, (state == DIO_STATE_HIGH) ? bit : 0,
+			(state == DIO_STATE_HIGH) ? 0 : bit, 0);
+		pthread_mutex_unlock(&sh->lock);
+	}
+
+	__atomic_add_fetch(&ctx->stats.dout_verifies, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ctx->stats.dout_mismatches, __builtin_popcountll(mismatched),
+		__ATOMIC_RELAXED);
+	return mismatched;
+}
+
+/*
+ * Read the DIN ports selected by mask in one pass and pack their states
+ * into *bitmap. Returns the mask of ports that were read successfully.
+ */
+static uint64_t get_din_multi_state(struct mx_dio_ctx *ctx, uint64_t mask, uint64_t *bitmap)
+{
+	struct dio_backend *be = &ctx->backend;
+	uint64_t ok = 0, states = 0, start;
+	int diport, state;
+
+	if (be->ops->caps & DIO_BACKEND_BULK_READ) {
+		start = op_stats_begin(&ctx->stats.din_read);
+		ok = be->ops->read_din_bulk(be, mask, bitmap);
+		op_stats_end(&ctx->stats.din_read, start, (ok == mask) ? 0 : -1);
+		return ok;
+	}
+
+	for (diport = 0; diport < ctx->config.num_of_din_ports; diport++) {
+		if (!(mask & (1ULL << diport)))
+			continue;
+
+		if (get_din_state(ctx, diport, &state) < 0)
+			continue;
+
+		ok |= 1ULL << diport;
+		if (state == DIO_STATE_HIGH)
+			states |= 1ULL << diport;
+	}
+
+	*bitmap = states;
+	return ok;
+}
+
+static inline uint64_t port_mask_all(int num_of_ports)
+{
+	return (num_of_ports == 64) ? ~0ULL : (1ULL << num_of_ports) - 1;
+}
+
+static inline int din_event_callback_is_set(const struct din_event_callback *cb)
+{
+	return cb->func != NULL || cb->legacy_func != NULL;
+}
+
+static inline void call_din_event(struct mx_dio_ctx *ctx,
+	const struct din_event_callback *cb, int diport)
+{
+	if (cb->func != NULL)
+		cb->func(ctx, diport, cb->arg);
+	else
+		cb->legacy_func(diport);
+}
+
+static void *din_dispatcher(void *arg)
+{
+	struct din_dispatcher_struct *d = (struct din_dispatcher_struct *) arg;
+	struct mx_dio_ctx *ctx = d->ctx;
+	struct din_dispatch_job job;
+	uint64_t start, elapsed;
+
+	pthread_mutex_lock(&d->lock);
+	while (1) {
+		while (d->head == d->tail && !d->stop)
+			pthread_cond_wait(&d->cond, &d->lock);
+
+		/* drain whatever is queued before honoring stop */
+		if (d->head == d->tail)
+			break;
+
+		job = d->jobs[d->tail & (DISPATCH_QUEUE_SIZE - 1)];
+		d->tail++;
+		pthread_mutex_unlock(&d->lock);
+
+		__atomic_sub_fetch(&ctx->din_dispatch_stats.queue_depth, 1, __ATOMIC_RELAXED);
+
+		start = get_monotonic_ns();
+		call_din_event(ctx, &job.cb, job.diport);
+		elapsed = get_monotonic_ns() - start;
+
+		__atomic_add_fetch(&ctx->din_dispatch_stats.dispatched, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&ctx->din_dispatch_stats.callback_time_total, elapsed,
+			__ATOMIC_RELAXED);
+		atomic_max_u64(&ctx->din_dispatch_stats.callback_time_max, elapsed);
+		event_stats_record(ctx, job.diport, job.detected);
+
+		pthread_mutex_lock(&d->lock);
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return NULL;
+}
+
+static void stop_din_dispatch(struct din_dispatch_struct *dispatch)
+{
+	struct din_dispatcher_struct *d;
+	int i;
+
+	for (i = 0; i < dispatch->num_of_threads; i++) {
+		d = &dispatch->dispatchers[i];
+		pthread_mutex_lock(&d->lock);
+		d->stop = 1;
+		pthread_cond_signal(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	for (i = 0; i < dispatch->num_of_threads; i++) {
+		d = &dispatch->dispatchers[i];
+		pthread_join(d->thread, NULL);
+		pthread_cond_destroy(&d->cond);
+		pthread_mutex_destroy(&d->lock);
+	}
+
+	free(dispatch->dispatchers);
+	free(dispatch);
+}
+
+static struct din_dispatch_struct *start_din_dispatch(struct mx_dio_ctx *ctx, int num_of_threads)
+{
+	struct din_dispatch_struct *dispatch;
+	struct din_dispatcher_struct *d;
+	int i;
+
+	dispatch = (struct din_dispatch_struct *)
+		calloc(1, sizeof(struct din_dispatch_struct));
+	if (dispatch == NULL)
+		return NULL;
+
+	dispatch->dispatchers = (struct din_dispatcher_struct *)
+		calloc(num_of_threads, sizeof(struct din_dispatcher_struct));
+	if (dispatch->dispatchers == NULL) {
+		free(dispatch);
+		return NULL;
+	}
+
+	for (i = 0; i < num_of_threads; i++) {
+		d = &dispatch->dispatchers[i];
+		d->ctx = ctx;
+		pthread_mutex_init(&d->lock, NULL);
+		pthread_cond_init(&d->cond, NULL);
+		if (pthread_create(&d->thread, NULL, din_dispatcher, d) != 0) {
+			pthread_cond_destroy(&d->cond);
+			pthread_mutex_destroy(&d->lock);
+			stop_din_dispatch(dispatch);
+			return NULL;
+		}
+		dispatch->num_of_threads++;
+	}
+
+	return dispatch;
+}
+
+/* detected: when the transition or hold time that fires the event was seen */
+static void fire_event(struct mx_dio_ctx *ctx, int diport, uint64_t detected)
+{
+	struct din_dispatcher_struct *d;
+	uint32_t depth, max;
+
+	if (ctx->din_dispatch == NULL) {
+		call_din_event(ctx, &ctx->din_event[diport].cb, diport);
+		event_stats_record(ctx, diport, detected);
+		return;
+	}
+
+	d = &ctx->din_dispatch->dispatchers[diport % ctx->din_dispatch->num_of_threads];
+
+	pthread_mutex_lock(&d->lock);
+	if (d->head - d->tail >= DISPATCH_QUEUE_SIZE) {
+		pthread_mutex_unlock(&d->lock);
+		__atomic_add_fetch(&ctx->din_dispatch_stats.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	d->jobs[d->head & (DISPATCH_QUEUE_SIZE - 1)].cb = ctx->din_event[diport].cb;
+	d->jobs[d->head & (DISPATCH_QUEUE_SIZE - 1)].diport = diport;
+	d->jobs[d->head & (DISPATCH_QUEUE_SIZE - 1)].detected = detected;
+	d->head++;
+	pthread_cond_signal(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+
+	__atomic_add_fetch(&ctx->din_dispatch_stats.queued, 1, __ATOMIC_RELAXED);
+	depth = __atomic_add_fetch(&ctx->din_dispatch_stats.queue_depth, 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&ctx->din_dispatch_stats.max_queue_depth, __ATOMIC_RELAXED);
+	if (depth > max)
+		__atomic_store_n(&ctx->din_dispatch_stats.max_queue_depth, depth, __ATOMIC_RELAXED);
+}
+
+static void check_event(struct mx_dio_ctx *ctx, int diport, int state, uint64_t ts)
+{
+	struct din_event_struct *ev;
+
+	ev = &ctx->din_event[diport];
+
+	if (ev->duration == 0) {
+		if (state != ev->last_state) {
+			if ((ev->mode == DIN_EVENT_HIGH_TO_LOW && state == DIO_STATE_LOW) ||
+				(ev->mode == DIN_EVENT_LOW_TO_HIGH && state == DIO_STATE_HIGH) ||
+				(ev->mode == DIN_EVENT_STATE_CHANGE)) {
+				if (ctx->recorder != NULL)
+					dio_recorder_add(ctx->recorder, ts, diport, DIO_RECORD_DIN,
+						ev->last_state, state, DIO_RECORD_SRC_EVENT);
+				fire_event(ctx, diport, ts);
+			}
+			ev->last_state = state;
+		}
+	} else {
+		if (state != ev->last_state) {
+			if ((ev->mode == DIN_EVENT_LOW_TO_HIGH && state == DIO_STATE_HIGH) ||
+				(ev->mode == DIN_EVENT_HIGH_TO_LOW && state == DIO_STATE_LOW) ||
+				(ev->mode == DIN_EVENT_STATE_CHANGE)) {
+				ev->start_time = ts;
+				ev->checking = 1;
+			} else if ((ev->mode == DIN_EVENT_HIGH_TO_LOW && state == DIO_STATE_HIGH) ||
+				(ev->mode == DIN_EVENT_LOW_TO_HIGH && state == DIO_STATE_LOW)) {
+				ev->checking = 0;
+			}
+			ev->last_state = state;
+		} else if (ev->checking == 1) {
+			if (ts - ev->start_time >= ev->duration) {
+				if (ctx->recorder != NULL)
+					dio_recorder_add(ctx->recorder,
+						ev->start_time + ev->duration, diport,
+						DIO_RECORD_DIN, state, state, DIO_RECORD_SRC_EVENT);
+				fire_event(ctx, diport, ev->start_time + ev->duration);
+				ev->checking = 0;
+			}
+		}
+	}
+}
+
+static void din_debounce_set_limit(struct mx_dio_ctx *ctx, int diport, int samples)
+{
+	uint64_t bit = 1ULL << diport;
+	int k;
+
+	for (k = 0; k < DEBOUNCE_COUNT_BITS; k++) {
+		ctx->din_debounce.count[k] &= ~bit;
+		if ((samples >> k) & 1)
+			ctx->din_debounce.limit[k] |= bit;
+		else
+			ctx->din_debounce.limit[k] &= ~bit;
+	}
+
+	if (samples <= 1)
+		ctx->din_debounce.bypass |= bit;
+	else
+		ctx->din_debounce.bypass &= ~bit;
+}
+
+/*
+ * Drop the filter state of ports that are no longer watched, so they start
+ * from their raw level when they are watched again.
+ */
+static void din_debounce_keep(struct mx_dio_ctx *ctx, uint64_t mask)
+{
+	int k;
+
+	ctx->din_debounce.valid &= mask;
+	for (k = 0; k < DEBOUNCE_COUNT_BITS; k++)
+		ctx->din_debounce.count[k] &= mask;
+}
+
+/* ports whose filter is still counting towards a new level */
+static uint64_t din_debounce_pending(struct mx_dio_ctx *ctx)
+{
+	uint64_t pending = 0;
+	int k;
+
+	for (k = 0; k < DEBOUNCE_COUNT_BITS; k++)
+		pending |= ctx->din_debounce.count[k];
+	return pending;
+}
+
+/*
+ * Feed raw levels of the ports in mask through the filter and return the
+ * debounced levels of all ports.
+ */
+static uint64_t din_debounce_update(struct mx_dio_ctx *ctx, uint64_t mask, uint64_t raw)
+{
+	struct din_debounce_struct *f = &ctx->din_debounce;
+	uint64_t fresh, diff, same, carry, tmp, hit;
+	int k;
+
+	/* the first sample of a port is taken as is */
+	fresh = mask & ~f->valid;
+	f->level = (f->level & ~fresh) | (raw & fresh);
+	f->valid |= fresh;
+
+	diff = (raw ^ f->level) & mask;
+	same = mask & ~diff;
+
+	f->level ^= diff & f->bypass;
+	diff &= ~f->bypass;
+
+	/* reset the counters of stable ports, count up the others */
+	carry = diff;
+	for (k = 0; k < DEBOUNCE_COUNT_BITS; k++) {
+		f->count[k] &= ~same;
+		tmp = f->count[k] & carry;
+		f->count[k] ^= carry;
+		carry = tmp;
+	}
+
+	hit = diff;
+	for (k = 0; k < DEBOUNCE_COUNT_BITS; k++)
+		hit &= ~(f->count[k] ^ f->limit[k]);
+
+	f->level ^= hit;
+	for (k = 0; k < DEBOUNCE_COUNT_BITS; k++)
+		f->count[k] &= ~hit;
+
+	return f->level;
+}
+
+static void din_event_publish(struct mx_dio_ctx *ctx, int diport,
+	const struct din_event_callback *cb, int mode, uint64_t duration)
+{
+	struct din_event_slot *slot = &ctx->din_event_slot[diport];
+	uint32_t seq;
+
+	/* only writers of the same port can make us spin */
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	do {
+		while (seq & 1)
+			seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&slot->cb.func, cb->func, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->cb.legacy_func, cb->legacy_func, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->cb.arg, cb->arg, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->mode, mode, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->duration, duration, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_or_fetch(&ctx->din_event_dirty, 1ULL << diport, __ATOMIC_RELEASE);
+}
+
+static void din_event_read_slot(struct mx_dio_ctx *ctx, int diport,
+	struct din_event_slot *out)
+{
+	struct din_event_slot *slot = &ctx->din_event_slot[diport];
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		out->cb.func = __atomic_load_n(&slot->cb.func, __ATOMIC_RELAXED);
+		out->cb.legacy_func = __atomic_load_n(&slot->cb.legacy_func, __ATOMIC_RELAXED);
+		out->cb.arg = __atomic_load_n(&slot->cb.arg, __ATOMIC_RELAXED);
+		out->mode = __atomic_load_n(&slot->mode, __ATOMIC_RELAXED);
+		out->duration = __atomic_load_n(&slot->duration, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&slot->seq, __ATOMIC_RELAXED));
+}
+
+/* called by the DIN poll thread to pick up new debounce filters */
+static void din_debounce_apply(struct mx_dio_ctx *ctx)
+{
+	uint64_t dirty;
+	int i;
+
+	dirty = __atomic_exchange_n(&ctx->din_debounce_dirty, 0, __ATOMIC_ACQUIRE);
+	for (; dirty != 0; dirty &= dirty - 1) {
+		i = __builtin_ctzll(dirty);
+		din_debounce_set_limit(ctx, i,
+			__atomic_load_n(&ctx->config.din_ports[i].debounce_samples, __ATOMIC_RELAXED));
+	}
+}
+
+/* called by the DIN poll thread to pick up new registrations */
+static void din_event_apply(struct mx_dio_ctx *ctx)
+{
+	struct din_event_slot slot;
+	uint64_t dirty;
+	int i;
+
+	dirty = __atomic_exchange_n(&ctx->din_event_dirty, 0, __ATOMIC_ACQUIRE);
+	for (i = 0; dirty != 0; i++, dirty >>= 1) {
+		if (!(dirty & 1))
+			continue;
+
+		din_event_read_slot(ctx, i, &slot);
+		ctx->din_event[i].cb = slot.cb;
+		ctx->din_event[i].mode = slot.mode;
+		ctx->din_event[i].duration = slot.duration;
+	}
+}
+
+static inline int din_event_is_set(struct mx_dio_ctx *ctx, int diport)
+{
+	return din_event_callback_is_set(&ctx->din_event[diport].cb) &&
+		ctx->din_event[diport].mode != DIN_EVENT_CLEAR;
+}
+
+static inline int din_port_is_watched(struct mx_dio_ctx *ctx, int diport)
+{
+	return ctx->din_event_ring.buf != NULL || ctx->recorder != NULL ||
+		din_event_is_set(ctx, diport) ||
+		(__atomic_load_n(&ctx->din_counting, __ATOMIC_RELAXED) & (1ULL << diport));
+}
+
+/* only writers of the same port can make us spin */
+static uint32_t din_counter_write_begin(struct din_counter_struct *c)
+{
+	uint32_t seq;
+
+	seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+	do {
+		while (seq & 1)
+			seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&c->seq, &seq, seq + 1, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	return seq;
+}
+
+static inline void din_counter_write_end(struct din_counter_struct *c, uint32_t seq)
+{
+	__atomic_store_n(&c->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void din_counter_clear(struct din_counter_struct *c)
+{
+	uint32_t seq = din_counter_write_begin(c);
+
+	c->rising = 0;
+	c->falling = 0;
+	c->last_edge = 0;
+	memset(c->buckets, 0, sizeof(c->buckets));
+	din_counter_write_end(c, seq);
+}
+
+static void din_counter_edge(struct mx_dio_ctx *ctx, int diport, int state, uint64_t ts)
+{
+	struct din_counter_struct *c = &ctx->din_counter[diport];
+	struct din_counter_bucket *b;
+	uint64_t idx;
+	uint32_t seq;
+
+	seq = din_counter_write_begin(c);
+	c->last_edge = ts;
+	if (state == DIO_STATE_LOW) {
+		c->falling++;
+		din_counter_write_end(c, seq);
+		return;
+	}
+	c->rising++;
+
+	idx = ts / (ctx->config.din_counter_window / DIN_COUNTER_BUCKETS);
+	b = &c->buckets[idx % DIN_COUNTER_BUCKETS];
+	if (b->idx != idx || b->count == 0) {
+		b->idx = idx;
+		b->count = 0;
+		b->first = ts;
+	}
+	b->count++;
+	b->last = ts;
+	din_counter_write_end(c, seq);
+}
+
+static void din_counter_read(struct mx_dio_ctx *ctx, int diport, uint64_t now,
+	struct mx_din_counter *counter)
+{
+	struct din_counter_struct *src = &ctx->din_counter[diport];
+	struct din_counter_struct snap, *c = &snap;
+	struct din_counter_bucket *b;
+	uint64_t cur, n = 0, first = UINT64_MAX, last = 0;
+	uint32_t seq;
+	int i;
+
+	do {
+		seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+		memcpy(&snap, src, sizeof(snap));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&src->seq, __ATOMIC_RELAXED));
+
+	cur = now / (ctx->config.din_counter_window / DIN_COUNTER_BUCKETS);
+	for (i = 0; i < DIN_COUNTER_BUCKETS; i++) {
+		b = &c->buckets[i];
+		if (b->count == 0 || b->idx > cur || b->idx + DIN_COUNTER_BUCKETS <= cur)
+			continue;
+		n += b->count;
+		if (b->first < first)
+			first = b->first;
+		if (b->last > last)
+			last = b->last;
+	}
+
+	counter->rising = c->rising;
+	counter->falling = c->falling;
+	counter->last_edge = c->last_edge;
+	counter->period = 0;
+	counter->frequency = 0;
+	if (n >= 2 && last > first) {
+		counter->period = (last - first) / (n - 1);
+		counter->frequency = (n - 1) * 1e9 / (last - first);
+	}
+}
+
+static void push_din_event(struct mx_dio_ctx *ctx, int diport, int old_state, int new_state, uint64_t ts)
+{
+	struct din_event_ring_struct *ring = &ctx->din_event_ring;
+	struct mx_din_event *rec;
+	uint64_t seq, head;
+
+	seq = ring->seq++;
+	head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ring->size)
+		return; /* overrun */
+
+	rec = &ring->buf[head & (ring->size - 1)];
+	rec->seq = seq;
+	rec->timestamp = ts;
+	rec->port = diport;
+	rec->old_state = old_state;
+	rec->new_state = new_state;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+	ring->pushed = 1;
+}
+
+/*
+ * Make event_fd readable unless a reader has already been told and has not
+ * drained the buffer since. So there is at most one write() per drain.
+ */
+static void kick_din_event_fd(struct din_event_ring_struct *ring, int fd)
+{
+	uint64_t one = 1;
+
+	if (__atomic_exchange_n(&ring->armed, 0, __ATOMIC_SEQ_CST) == 0)
+		return;
+
+	if (write(fd, &one, sizeof(one)) < 0)
+		return; /* already readable */
+}
+
+/* called once per poll cycle */
+static void notify_din_events(struct mx_dio_ctx *ctx)
+{
+	struct din_event_ring_struct *ring = &ctx->din_event_ring;
+	int fd;
+
+	if (!ring->pushed)
+		return;
+	ring->pushed = 0;
+
+	fd = __atomic_load_n(&ring->event_fd, __ATOMIC_ACQUIRE);
+	if (fd >= 0)
+		kick_din_event_fd(ring, fd);
+}
+
+/*
+ * Feed one sampled level of a DIN port to the event buffer and to the
+ * registered event.
+ */
+static void din_port_sample(struct mx_dio_ctx *ctx, int diport, int state, uint64_t ts)
+{
+	uint64_t bit = 1ULL << diport;
+	int last = (ctx->din_states & bit) ? DIO_STATE_HIGH : DIO_STATE_LOW;
+
+	if ((ctx->din_states_valid & bit) && state != last && ctx->din_event_ring.buf != NULL)
+		push_din_event(ctx, diport, last, state, ts);
+
+	if ((ctx->din_states_valid & bit) && state != last &&
+		(__atomic_load_n(&ctx->din_counting, __ATOMIC_RELAXED) & bit))
+		din_counter_edge(ctx, diport, state, ts);
+
+	if (ctx->recorder != NULL && (ctx->din_states_valid & bit) && state != last)
+		dio_recorder_add(ctx->recorder, ts, diport, DIO_RECORD_DIN, last, state,
+			DIO_RECORD_SRC_SAMPLE);
+
+	ctx->din_states = (state == DIO_STATE_HIGH) ? (ctx->din_states | bit) : (ctx->din_states & ~bit);
+	ctx->din_states_valid |= bit;
+
+	if (din_event_is_set(ctx, diport))
+		check_event(ctx, diport, state, ts);
+}
+
+static void din_poll_wake(struct mx_dio_ctx *ctx)
+{
+	int fd = __atomic_load_n(&ctx->din_poll_thread.wake_fd, __ATOMIC_ACQUIRE);
+	uint64_t one = 1;
+
+	/* no poll thread yet: it picks up the change when it starts */
+	if (fd < 0)
+		return;
+
+	if (write(fd, &one, sizeof(one)) < 0)
+		return; /* the counter is already non-zero */
+}
+
+/*
+ * Fires expired duration events and returns the CLOCK_MONOTONIC time in ns
+ * at which the earliest pending duration check expires, or UINT64_MAX if
+ * there is none.
+ */
+static uint64_t check_din_duration_deadline(struct mx_dio_ctx *ctx, uint64_t now)
+{
+	struct din_event_struct *ev;
+	uint64_t deadline = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < ctx->config.num_of_din_ports; i++) {
+		ev = &ctx->din_event[i];
+		if (!din_event_is_set(ctx, i) || ev->checking == 0)
+			continue;
+
+		/* fires the event if the hold time has expired */
+		check_event(ctx, i, ev->last_state, now);
+		if (ev->checking == 0)
+			continue;
+
+		if (ev->start_time + ev->duration < deadline)
+			deadline = ev->start_time + ev->duration;
+	}
+
+	return deadline;
+}
+
+/*
+ * Account how late the poll thread woke up for a timed deadline.
+ */
+static void update_din_poll_timing(struct mx_dio_ctx *ctx, uint64_t deadline, uint64_t now)
+{
+	uint64_t late = (now > deadline) ? now - deadline : 0;
+
+	__atomic_add_fetch(&ctx->din_poll_timing.wakeups, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ctx->din_poll_timing.jitter_total, late, __ATOMIC_RELAXED);
+	if (late > ctx->din_poll_timing.jitter_max)
+		__atomic_store_n(&ctx->din_poll_timing.jitter_max, late, __ATOMIC_RELAXED);
+}
+
+/*
+ * Edge mode, for backends that report DIN transitions: the poll thread
+ * sleeps in wait_events() instead of reading every port periodically.
+ * Ports are only read when the thread is woken up for a registration
+ * change or while their debounce filter is still counting.
+ */
+static void din_poll_edge(struct mx_dio_ctx *ctx)
+{
+	struct dio_backend *be = &ctx->backend;
+	struct din_edge edges[MAX_DIN_EDGES];
+	uint64_t ts, now, deadline, watched, edged, reread, ok, states, sampled, raw, levels, bit;
+	uint64_t interval;
+	int rescan = 1, woken, n = 0, state, i, k;
+
+	while (1) {
+		pthread_mutex_lock(&ctx->din_poll_thread.lock);
+		if (__atomic_load_n(&ctx->din_poll_thread.stop, __ATOMIC_ACQUIRE)) {
+			pthread_mutex_unlock(&ctx->din_poll_thread.lock);
+			return;
+		}
+		din_event_apply(ctx);
+		din_debounce_apply(ctx);
+
+		ts = get_monotonic_ns();
+		watched = 0;
+		for (i = 0; i < ctx->config.num_of_din_ports; i++) {
+			if (din_port_is_watched(ctx, i))
+				watched |= 1ULL << i;
+		}
+		ctx->din_states_valid &= watched;
+		din_debounce_keep(ctx, watched);
+
+		edged = 0;
+		sampled = 0;
+		raw = 0;
+		for (k = 0; k < n; k++) {
+			i = edges[k].diport;
+			bit = 1ULL << i;
+			if (!(watched & bit))
+				continue;
+			edged |= bit;
+
+			if (!(ctx->din_debounce.bypass & bit)) {
+				sampled |= bit;
+				raw = (edges[k].state == DIO_STATE_HIGH) ? (raw | bit) : (raw & ~bit);
+				continue;
+			}
+
+			/*
+			 * An edge was reported but the line is back at its
+			 * previous level: a pulse shorter than our wakeup
+			 * latency. Replay both transitions.
+			 */
+			if ((ctx->din_states_valid & bit) &&
+				edges[k].state == (int) ((ctx->din_states >> i) & 1))
+				din_port_sample(ctx, i, !edges[k].state, edges[k].ts);
+			din_port_sample(ctx, i, edges[k].state, edges[k].ts);
+		}
+
+		/* debounced ports are resampled until their filter settles */
+		reread = (rescan ? watched : din_debounce_pending(ctx)) & ~edged;
+		rescan = 0;
+		if (reread) {
+			ok = get_din_multi_state(ctx, reread, &states);
+			for (i = 0; i < ctx->config.num_of_din_ports; i++) {
+				bit = 1ULL << i;
+				if (!(ok & bit))
+					continue;
+
+				state = (states >> i) & 1;
+				if (ctx->din_debounce.bypass & bit) {
+					din_port_sample(ctx, i, state, ts);
+					continue;
+				}
+				sampled |= bit;
+				raw = (state == DIO_STATE_HIGH) ? (raw | bit) : (raw & ~bit);
+			}
+		}
+
+		if (sampled) {
+			levels = din_debounce_update(ctx, sampled, raw);
+			for (i = 0; i < ctx->config.num_of_din_ports; i++) {
+				if (sampled & (1ULL << i))
+					din_port_sample(ctx, i, (levels >> i) & 1, ts);
+			}
+		}
+
+		now = get_monotonic_ns();
+		deadline = check_din_duration_deadline(ctx, now);
+		notify_din_events(ctx);
+
+		reread = din_debounce_pending(ctx);
+		for (i = 0; i < ctx->config.num_of_din_ports; i++) {
+			if (!(reread & (1ULL << i)))
+				continue;
+			interval = (uint64_t) __atomic_load_n(&ctx->config.din_ports[i].polling_interval,
+				__ATOMIC_RELAXED) * 1000;
+			if (ts + interval < deadline)
+				deadline = ts + interval;
+		}
+
+		hist_record(&ctx->stats.poll_cycle, get_monotonic_ns() - ts);
+		pthread_mutex_unlock(&ctx->din_poll_thread.lock);
+
+		n = be->ops->wait_events(be, watched, deadline, edges, MAX_DIN_EDGES, &woken);
+		if (n == 0 && !woken && deadline != UINT64_MAX)
+			update_din_poll_timing(ctx, deadline, get_monotonic_ns());
+		if (n < 0)
+			n = 0;
+		rescan = woken;
+	}
+}
+
+static void din_sched_swap(struct mx_dio_ctx *ctx, int a, int b)
+{
+	struct din_sched_entry tmp = ctx->din_sched.heap[a];
+
+	ctx->din_sched.heap[a] = ctx->din_sched.heap[b];
+	ctx->din_sched.heap[b] = tmp;
+}
+
+static void din_sched_push(struct mx_dio_ctx *ctx, int diport, uint64_t deadline)
+{
+	int i = ctx->din_sched.len++;
+
+	ctx->din_sched.heap[i].deadline = deadline;
+	ctx->din_sched.heap[i].diport = diport;
+	while (i > 0 && ctx->din_sched.heap[(i - 1) / 2].deadline > ctx->din_sched.heap[i].deadline) {
+		din_sched_swap(ctx, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static struct din_sched_entry din_sched_pop(struct mx_dio_ctx *ctx)
+{
+	struct din_sched_entry top = ctx->din_sched.heap[0];
+	int i = 0, child;
+
+	ctx->din_sched.heap[0] = ctx->din_sched.heap[--ctx->din_sched.len];
+	while ((child = 2 * i + 1) < ctx->din_sched.len) {
+		if (child + 1 < ctx->din_sched.len &&
+			ctx->din_sched.heap[child + 1].deadline < ctx->din_sched.heap[child].deadline)
+			child++;
+		if (ctx->din_sched.heap[i].deadline <= ctx->din_sched.heap[child].deadline)
+			break;
+		din_sched_swap(ctx, i, child);
+		i = child;
+	}
+	return top;
+}
+
+/*
+ * Keep the heap in sync with the watched ports. Ports that just became
+ * watched are due at once; the others keep their deadlines.
+ */
+static void din_sched_update(struct mx_dio_ctx *ctx, uint64_t watched, uint64_t now)
+{
+	struct din_sched_entry old[MAX_DIO_PORTS];
+	int i, len, reset;
+
+	reset = __atomic_exchange_n(&ctx->din_sched.reset, 0, __ATOMIC_ACQUIRE);
+	if (watched == ctx->din_sched.mask && !reset)
+		return;
+
+	len = ctx->din_sched.len;
+	memcpy(old, ctx->din_sched.heap, len * sizeof(struct din_sched_entry));
+	ctx->din_sched.len = 0;
+
+	for (i = 0; i < len; i++) {
+		if ((watched & (1ULL << old[i].diport)) && !reset)
+			din_sched_push(ctx, old[i].diport, old[i].deadline);
+	}
+
+	for (i = 0; i < ctx->config.num_of_din_ports; i++) {
+		if ((watched & (1ULL << i)) &&
+			(!(ctx->din_sched.mask & (1ULL << i)) || reset))
+			din_sched_push(ctx, i, now);
+	}
+
+	ctx->din_sched.mask = watched;
+}
+
+/*
+ * Pop every port whose deadline has passed, schedule its next read and
+ * return them as a mask.
+ */
+static uint64_t din_sched_pop_due(struct mx_dio_ctx *ctx, uint64_t now)
+{
+	struct din_sched_entry e;
+	uint64_t due = 0, interval;
+
+	while (ctx->din_sched.len > 0 && ctx->din_sched.heap[0].deadline <= now) {
+		e = din_sched_pop(ctx);
+		due |= 1ULL << e.diport;
+
+		interval = (uint64_t) __atomic_load_n(&ctx->config.din_ports[e.diport].polling_interval,
+			__ATOMIC_RELAXED) * 1000;
+		e.deadline += interval;
+		if (e.deadline <= now) {
+			/* skip missed periods instead of bursting to catch up */
+			__atomic_add_fetch(&ctx->din_poll_timing.overruns, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&ctx->stats.poll_overruns, 1, __ATOMIC_RELAXED);
+			e.deadline = now + interval;
+		}
+		din_sched_push(ctx, e.diport, e.deadline);
+	}
+	return due;
+}
+
+/*
+ * Sleep until deadline (CLOCK_MONOTONIC, in ns) or until wake_fd is kicked
+ * for a registration or interval change, or for close. Returns 1 when
+ * woken up early.
+ */
+static int din_poll_sleep(struct mx_dio_ctx *ctx, uint64_t deadline)
+{
+	struct pollfd pfd;
+	struct timespec timeout;
+	uint64_t now, val;
+	int ret;
+
+	pfd.fd = ctx->din_poll_thread.wake_fd;
+	pfd.events = POLLIN;
+	while (1) {
+		now = get_monotonic_ns();
+		if (now >= deadline)
+			return 0;
+
+		ns_to_timespec(deadline - now, &timeout);
+		ret = ppoll(&pfd, 1, &timeout, NULL);
+		if (ret == 0)
+			return 0;
+		if (ret > 0 && read(pfd.fd, &val, sizeof(val)) > 0)
+			return 1;
+		if (ret < 0 && errno != EINTR)
+			return 0;
+	}
+}
+
+static void *din_poll(void *arg)
+{
+	struct mx_dio_ctx *ctx = (struct mx_dio_ctx *) arg;
+	struct dio_backend *be = &ctx->backend;
+	uint64_t watched, due, ok, states, start, ts, deadline;
+	int i;
+
+	/* polling stays as the fallback when edges cannot be set up */
+	if ((be->ops->caps & DIO_BACKEND_EDGE_EVENTS) && be->ops->start_events(be) == 0) {
+		din_poll_edge(ctx);
+		be->ops->stop_events(be);
+	}
+
+	while (1) {
+		pthread_mutex_lock(&ctx->din_poll_thread.lock);
+		if (__atomic_load_n(&ctx->din_poll_thread.stop, __ATOMIC_ACQUIRE)) {
+			pthread_mutex_unlock(&ctx->din_poll_thread.lock);
+			break;
+		}
+		din_event_apply(ctx);
+		din_debounce_apply(ctx);
+		start = get_monotonic_ns();
+
+		watched = 0;
+		for (i = 0; i < ctx->config.num_of_din_ports; i++) {
+			if (din_port_is_watched(ctx, i))
+				watched |= 1ULL << i;
+		}
+		ctx->din_states_valid &= watched;
+		din_debounce_keep(ctx, watched);
+
+		ts = start;
+		din_sched_update(ctx, watched, ts);
+
+		due = din_sched_pop_due(ctx, ts);
+		ok = get_din_multi_state(ctx, due, &states);
+		states = din_debounce_update(ctx, ok, states);
+		for (i = 0; i < ctx->config.num_of_din_ports; i++) {
+			if (ok & (1ULL << i))
+				din_port_sample(ctx, i, (states >> i) & 1, ts);
+		}
+
+		/* sleep until the next port is due or a hold time expires */
+		ts = get_monotonic_ns();
+		deadline = check_din_duration_deadline(ctx, ts);
+		notify_din_events(ctx);
+		if (ctx->din_sched.len > 0 && ctx->din_sched.heap[0].deadline < deadline)
+			deadline = ctx->din_sched.heap[0].deadline;
+		if (deadline == UINT64_MAX)
+			deadline = ts + (uint64_t) ctx->config.din_polling_interval * 1000;
+
+		hist_record(&ctx->stats.poll_cycle, get_monotonic_ns() - start);
+		pthread_mutex_unlock(&ctx->din_poll_thread.lock);
+
+		/* an early wakeup rebuilds the schedule before the deadline */
+		if (!din_poll_sleep(ctx, deadline))
+			update_din_poll_timing(ctx, deadline, get_monotonic_ns());
+	}
+
+	return NULL;
+}
+
+static int get_thread_stack(pthread_t thread, void **addr, size_t *size)
+{
+	pthread_attr_t attr;
+	int ret;
+
+	if (pthread_getattr_np(thread, &attr) != 0)
+		return -1;
+	ret = pthread_attr_getstack(&attr, addr, size);
+	pthread_attr_destroy(&attr);
+	return (ret == 0) ? 0 : -1;
+}
+
+/*
+ * The working set of the DIN polling path: the context, the event buffer
+ * and the stack of the poll thread. mlock() also faults the pages in, so
+ * the poll thread takes no page faults afterwards. Called with
+ * din_poll_thread.start_lock held and the poll thread running.
+ */
+static int din_poll_lock_memory(struct mx_dio_ctx *ctx, int lock)
+{
+	struct din_event_ring_struct *ring = &ctx->din_event_ring;
+	void *stack;
+	size_t stack_size;
+	int ret = 0;
+
+	if (get_thread_stack(ctx->din_poll_thread.thread, &stack, &stack_size) < 0)
+		return -1; /* E_SYSFUNCERR */
+
+	pthread_mutex_lock(&ring->read_lock);
+	if (lock) {
+		if (mlock(ctx, sizeof(struct mx_dio_ctx)) < 0 ||
+			mlock(stack, stack_size) < 0 ||
+			(ring->buf != NULL &&
+				mlock(ring->buf, ring->size * sizeof(struct mx_din_event)) < 0))
+			ret = -1; /* E_SYSFUNCERR */
+	}
+	if (!lock || ret < 0) {
+		munlock(ctx, sizeof(struct mx_dio_ctx));
+		munlock(stack, stack_size);
+		if (ring->buf != NULL)
+			munlock(ring->buf, ring->size * sizeof(struct mx_din_event));
+	}
+	ctx->din_poll_thread.memory_locked = lock && ret == 0;
+	pthread_mutex_unlock(&ring->read_lock);
+
+	return ret;
+}
+
+/*
+ * Apply the requested scheduling to the running DIN poll thread. A setting
+ * the process is not allowed to make is left as it is and the others are
+ * still applied; mx_din_get_poll_thread_attr() tells what took effect.
+ * Called with din_poll_thread.start_lock held.
+ */
+static int apply_din_poll_thread_attr(struct mx_dio_ctx *ctx)
+{
+	struct mx_din_poll_thread_attr *attr = &ctx->config.din_poll_attr;
+	pthread_t thread = ctx->din_poll_thread.thread;
+	struct sched_param param;
+	cpu_set_t cpus;
+	int cpu, ret = 0;
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = attr->priority;
+	if (pthread_setschedparam(thread, attr->policy, &param) != 0)
+		ret = -1; /* E_SYSFUNCERR */
+
+	CPU_ZERO(&cpus);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (attr->cpus == 0 || (cpu < 64 && (attr->cpus & (1ULL << cpu))))
+			CPU_SET(cpu, &cpus);
+	}
+	if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus) != 0)
+		ret = -1; /* E_SYSFUNCERR */
+
+	if ((attr->lock_memory || ctx->din_poll_thread.memory_locked) &&
+		din_poll_lock_memory(ctx, attr->lock_memory) < 0)
+		ret = -1; /* E_SYSFUNCERR */
+
+	return ret;
+}
+
+/* called with din_poll_thread.start_lock held */
+static int start_din_poll_thread(struct mx_dio_ctx *ctx)
+{
+	struct mx_din_poll_thread_attr *attr = &ctx->config.din_poll_attr;
+	pthread_attr_t thread_attr;
+	int ret, fd;
+
+	fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fd < 0)
+		return -1; /* E_SYSFUNCERR */
+	ctx->backend.wake_fd = fd;
+	__atomic_store_n(&ctx->din_poll_thread.wake_fd, fd, __ATOMIC_RELEASE);
+
+	if (ctx->config.din_dispatch_threads > 0) {
+		ctx->din_dispatch = start_din_dispatch(ctx, ctx->config.din_dispatch_threads);
+		if (ctx->din_dispatch == NULL) {
+			close(ctx->din_poll_thread.wake_fd);
+			ctx->din_poll_thread.wake_fd = -1;
+			ctx->backend.wake_fd = -1;
+			return -1; /* E_SYSFUNCERR */
+		}
+	}
+
+	pthread_attr_init(&thread_attr);
+	if (attr->stack_size != 0)
+		pthread_attr_setstacksize(&thread_attr, attr->stack_size);
+
+	__atomic_store_n(&ctx->din_poll_thread.flag, 1, __ATOMIC_RELEASE);
+	ret = pthread_create(&ctx->din_poll_thread.thread, &thread_attr, din_poll, ctx);
+	pthread_attr_destroy(&thread_attr);
+	if (ret != 0) {
+		if (ctx->din_dispatch != NULL) {
+			stop_din_dispatch(ctx->din_dispatch);
+			ctx->din_dispatch = NULL;
+		}
+		close(ctx->din_poll_thread.wake_fd);
+		ctx->din_poll_thread.wake_fd = -1;
+		ctx->backend.wake_fd = -1;
+		__atomic_store_n(&ctx->din_poll_thread.flag, 0, __ATOMIC_RELEASE);
+		return -1; /* E_SYSFUNCERR */
+	}
+
+	/* the defaults keep what the thread inherited from its creator */
+	if (attr->policy != SCHED_OTHER || attr->cpus != 0 || attr->lock_memory)
+		apply_din_poll_thread_attr(ctx);
+	return 0;
+}
+
+/*
+ * DOUT pulse engine
+ */
+
+static int write_dout_edges(struct mx_dio_ctx *ctx, uint64_t set_bits,
+	uint64_t clear_bits)
+{
+	uint64_t bits = set_bits | clear_bits;
+	int ret;
+
+	if ((bits & (bits - 1)) == 0)
+		return set_dout_state(ctx, __builtin_ctzll(bits),
+			set_bits ? DIO_STATE_HIGH : DIO_STATE_LOW, DIO_RECORD_SRC_PULSE);
+
+	pthread_mutex_lock(&ctx->dout_multi_lock);
+	ret = set_dout_multi_state(ctx, set_bits, clear_bits, DIO_RECORD_SRC_PULSE);
+	pthread_mutex_unlock(&ctx->dout_multi_lock);
+	return ret;
+}
+
+static inline void pulse_stats_add(uint64_t val, uint64_t *total, uint64_t *min,
+	uint64_t *max)
+{
+	*total += val;
+	if (val < *min)
+		*min = val;
+	if (val > *max)
+		*max = val;
+}
+
+/*
+ * Account an edge of a port that took effect at t and schedule the next
+ * one. Called with dout_wave.lock held.
+ */
+static void dout_wave_edge(struct mx_dio_ctx *ctx, int doport, int ret,
+	uint64_t t)
+{
+	struct dout_wave_struct *w = &ctx->dout_wave.ports[doport];
+	struct mx_dout_pulse_stats *st = &w->stats;
+
+	if (ret < 0)
+		st->errors++;
+	if (t > w->next) {
+		st->lateness_total += t - w->next;
+		if (t - w->next > st->lateness_max)
+			st->lateness_max = t - w->next;
+	}
+
+	if (w->level == DIO_STATE_HIGH) {
+		if (w->risen != 0) {
+			st->periods++;
+			pulse_stats_add(t - w->risen, &st->period_total,
+				&st->period_min, &st->period_max);
+		}
+		w->risen = t;
+		w->level = DIO_STATE_LOW;
+		w->next = w->rise + w->width;
+		/* a rising edge later than the pulse width still gets its width */
+		if (w->next <= t) {
+			st->overruns++;
+			w->next = t + w->width;
+		}
+		return;
+	}
+
+	st->pulses++;
+	pulse_stats_add(t - w->risen, &st->width_total, &st->width_min,
+		&st->width_max);
+
+	if (w->remaining != UINT64_MAX)
+		w->remaining--;
+	if (w->remaining == 0) {
+		st->running = 0;
+		__atomic_and_fetch(&ctx->dout_wave.active, ~(1ULL << doport),
+			__ATOMIC_RELAXED);
+		return;
+	}
+
+	/* a late period starts at once rather than being dropped */
+	w->rise += w->period;
+	if (w->rise < t) {
+		st->overruns++;
+		w->rise = t;
+	}
+	w->level = DIO_STATE_HIGH;
+	w->next = w->rise;
+}
+
+static void *dout_wave(void *arg)
+{
+	struct mx_dio_ctx *ctx = (struct mx_dio_ctx *) arg;
+	struct dout_wave_thread_struct *dw = &ctx->dout_wave;
+	struct timespec wakeup;
+	uint64_t now, next, due, set_bits, clear_bits, t;
+	int i, ret;
+
+	pthread_mutex_lock(&dw->lock);
+	while (!dw->stop) {
+		now = get_monotonic_ns();
+		next = UINT64_MAX;
+		due = set_bits = clear_bits = 0;
+
+		/* the shadow is verified with dw->lock released: edges go first */
+		if (ctx->dout_shadow.verify_interval != 0 &&
+			__atomic_load_n(&ctx->dout_shadow.enabled, __ATOMIC_ACQUIRE)) {
+			if (ctx->dout_shadow.next_verify <= now) {
+				pthread_mutex_unlock(&dw->lock);
+				dout_shadow_verify(ctx, &ret);
+				pthread_mutex_lock(&dw->lock);
+				ctx->dout_shadow.next_verify = get_monotonic_ns() +
+					ctx->dout_shadow.verify_interval;
+				continue;
+			}
+			next = ctx->dout_shadow.next_verify;
+		}
+
+		for (i = 0; i < ctx->config.num_of_dout_ports; i++) {
+			if (!(dw->active & (1ULL << i)))
+				continue;
+
+			if (dw->ports[i].next > now) {
+				if (dw->ports[i].next < next)
+					next = dw->ports[i].next;
+				continue;
+			}
+
+			due |= 1ULL << i;
+			if (dw->ports[i].level == DIO_STATE_HIGH)
+				set_bits |= 1ULL << i;
+			else
+				clear_bits |= 1ULL << i;
+		}
+
+		if (due == 0) {
+			if (next == UINT64_MAX) {
+				pthread_cond_wait(&dw->cond, &dw->lock);
+			} else {
+				ns_to_timespec(next, &wakeup);
+				pthread_cond_timedwait(&dw->cond, &dw->lock, &wakeup);
+			}
+			continue;
+		}
+
+		ret = write_dout_edges(ctx, set_bits, clear_bits);
+		t = get_monotonic_ns();
+		for (i = 0; i < ctx->config.num_of_dout_ports; i++) {
+			if (due & (1ULL << i))
+				dout_wave_edge(ctx, i, ret, t);
+		}
+	}
+	pthread_mutex_unlock(&dw->lock);
+
+	return NULL;
+}
+
+/* called with dout_wave.lock held */
+static int start_dout_wave_thread(struct mx_dio_ctx *ctx)
+{
+	struct dout_wave_thread_struct *dw = &ctx->dout_wave;
+
+	if (dw->flag)
+		return 0;
+	if (pthread_create(&dw->thread, NULL, dout_wave, ctx) != 0)
+		return -1; /* E_SYSFUNCERR */
+	dw->flag = 1;
+	return 0;
+}
+
+/* period 0 is a single pulse, count 0 runs until stopped */
+static int dout_wave_start(struct mx_dio_ctx *ctx, int doport, uint64_t period,
+	uint64_t width, uint64_t count)
+{
+	struct dout_wave_thread_struct *dw = &ctx->dout_wave;
+	struct dout_wave_struct *w = &dw->ports[doport];
+
+	pthread_mutex_lock(&dw->lock);
+	if (start_dout_wave_thread(ctx) < 0) {
+		pthread_mutex_unlock(&dw->lock);
+		return -1; /* E_SYSFUNCERR */
+	}
+
+	memset(w, 0, sizeof(struct dout_wave_struct));
+	w->period = period;
+	w->width = width;
+	w->remaining = (count == 0) ? UINT64_MAX : count;
+	w->rise = get_monotonic_ns();
+	w->next = w->rise;
+	w->level = DIO_STATE_HIGH;
+	w->stats.requested_period = period;
+	w->stats.requested_width = width;
+	w->stats.width_min = UINT64_MAX;
+	w->stats.period_min = UINT64_MAX;
+	w->stats.running = 1;
+
+	__atomic_or_fetch(&dw->active, 1ULL << doport, __ATOMIC_RELAXED);
+	pthread_cond_signal(&dw->cond);
+	pthread_mutex_unlock(&dw->lock);
+
+	return 0;
+}
+
+/* the ports in mask leave the engine; an edge being written completes first */
+static void dout_wave_cancel(struct mx_dio_ctx *ctx, uint64_t mask)
+{
+	struct dout_wave_thread_struct *dw = &ctx->dout_wave;
+	int i;
+
+	if (!(__atomic_load_n(&dw->active, __ATOMIC_RELAXED) & mask))
+		return;
+
+	pthread_mutex_lock(&dw->lock);
+	for (i = 0; i < ctx->config.num_of_dout_ports; i++) {
+		if (dw->active & mask & (1ULL << i))
+			dw->ports[i].stats.running = 0;
+	}
+	__atomic_and_fetch(&dw->active, ~mask, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&dw->lock);
+}
+
+/*
+ * APIs
+ */
+
+int mx_dio_open(const char *conf_path, struct mx_dio_ctx **ctx_out)
+{
+	struct mx_dio_ctx *ctx;
+	struct json_object *conf;
+	pthread_condattr_t cond_attr;
+	const char *conf_ver;
+	int ret, i;
+
+	if (ctx_out == NULL)
+		return -2; /* E_INVAL */
+
+	if (conf_path == NULL)
+		conf_path = CONF_FILE;
+
+	conf = json_object_from_file(conf_path);
+	if (conf == NULL)
+		return -5; /* E_CONFERR */
+
+	if (obj_get_str(conf, "CONFIG_VERSION", &conf_ver) < 0) {
+		json_object_put(conf);
+		return -5; /* E_CONFERR */
+	}
+
+	ret = check_config_version_supported(conf_ver);
+	if (ret < 0) {
+		json_object_put(conf);
+		return ret;
+	}
+
+	ctx = (struct mx_dio_ctx *) calloc(1, sizeof(struct mx_dio_ctx));
+	if (ctx == NULL) {
+		json_object_put(conf);
+		return -1; /* E_SYSFUNCERR */
+	}
+
+	ret = load_config(ctx, conf);
+	json_object_put(conf);
+	if (ret < 0) {
+		free(ctx);
+		return ret;
+	}
+
+	pthread_mutex_init(&ctx->dout_multi_lock, NULL);
+	pthread_mutex_init(&ctx->dout_shadow.lock, NULL);
+	pthread_mutex_init(&ctx->dout_wave.lock, NULL);
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ctx->dout_wave.cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	pthread_mutex_init(&ctx->din_poll_thread.lock, NULL);
+	pthread_mutex_init(&ctx->din_poll_thread.start_lock, NULL);
+	pthread_mutex_init(&ctx->din_event_ring.read_lock, NULL);
+	ctx->din_poll_thread.wake_fd = -1;
+	ctx->din_event_ring.event_fd = -1;
+	ctx->din_event_ring.armed = 1;
+	ctx->din_debounce.bypass = ~0ULL;
+
+	for (i = 0; i < ctx->config.num_of_din_ports; i++)
+		din_debounce_set_limit(ctx, i, ctx->config.din_ports[i].debounce_samples);
+
+	init_din_event_array(ctx);
+
+	if (ctx->config.recorder_file[0] != '\0') {
+		ret = dio_recorder_open(ctx->config.recorder_file,
+			ctx->config.recorder_size, &ctx->recorder);
+		if (ret == 0 && ctx->config.num_of_din_ports > 0) {
+			/* every DIN port is recorded from the start */
+			pthread_mutex_lock(&ctx->din_poll_thread.start_lock);
+			ret = start_din_poll_thread(ctx);
+			pthread_mutex_unlock(&ctx->din_poll_thread.start_lock);
+		}
+		if (ret < 0) {
+			mx_dio_close(ctx);
+			return ret;
+		}
+	}
+
+	if (ctx->dout_shadow.enabled && ctx->dout_shadow.verify_interval != 0) {
+		ctx->dout_shadow.next_verify = get_monotonic_ns() +
+			ctx->dout_shadow.verify_interval;
+		pthread_mutex_lock(&ctx->dout_wave.lock);
+		ret = start_dout_wave_thread(ctx);
+		pthread_mutex_unlock(&ctx->dout_wave.lock);
+		if (ret < 0) {
+			mx_dio_close(ctx);
+			return ret;
+		}
+	}
+
+	*ctx_out = ctx;
+	return 0;
+}
+
+int mx_dio_close(struct mx_dio_ctx *ctx)
+{
+	int running;
+
+	if (ctx == NULL)
+		return -2; /* E_INVAL */
+
+	pthread_mutex_lock(&ctx->din_poll_thread.start_lock);
+	running = ctx->din_poll_thread.flag;
+	__atomic_store_n(&ctx->din_poll_thread.stop, 1, __ATOMIC_RELEASE);
+	if (ctx->din_poll_thread.memory_locked)
+		din_poll_lock_memory(ctx, 0);
+	pthread_mutex_unlock(&ctx->din_poll_thread.start_lock);
+
+	if (running) {
+		din_poll_wake(ctx);
+		pthread_join(ctx->din_poll_thread.thread, NULL);
+		close(ctx->din_poll_thread.wake_fd);
+	}
+
+	if (ctx->din_dispatch != NULL)
+		stop_din_dispatch(ctx->din_dispatch);
+
+	/* waveforms stop where they are */
+	pthread_mutex_lock(&ctx->dout_wave.lock);
+	running = ctx->dout_wave.flag;
+	ctx->dout_wave.stop = 1;
+	pthread_cond_signal(&ctx->dout_wave.cond);
+	pthread_mutex_unlock(&ctx->dout_wave.lock);
+	if (running)
+		pthread_join(ctx->dout_wave.thread, NULL);
+
+	if (ctx->din_event_ring.event_fd >= 0)
+		close(ctx->din_event_ring.event_fd);
+	free(ctx->din_event_ring.buf);
+	dio_recorder_close(ctx->recorder);
+
+	ctx->backend.ops->close(&ctx->backend);
+
+	pthread_mutex_destroy(&ctx->din_event_ring.read_lock);
+	pthread_mutex_destroy(&ctx->din_poll_thread.start_lock);
+	pthread_mutex_destroy(&ctx->din_poll_thread.lock);
+	pthread_cond_destroy(&ctx->dout_wave.cond);
+	pthread_mutex_destroy(&ctx->dout_wave.lock);
+	pthread_mutex_destroy(&ctx->dout_shadow.lock);
+	pthread_mutex_destroy(&ctx->dout_multi_lock);
+	free(ctx);
+
+	return 0;
+}
+
+int mx_dio_init(void)
+{
+	struct mx_dio_ctx *ctx;
+	int ret = 0;
+
+	pthread_mutex_lock(&default_ctx_lock);
+	if (default_ctx == NULL) {
+		ret = mx_dio_open(CONF_FILE, &ctx);
+		if (ret == 0)
+			__atomic_store_n(&default_ctx, ctx, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&default_ctx_lock);
+
+	return ret;
+}
+
+int mx_dio_get_num_of_ports_ctx(struct mx_dio_ctx *ctx, int *num_of_din_ports,
+	int *num_of_dout_ports)
+{
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (num_of_din_ports != NULL)
+		*num_of_din_ports = ctx->config.num_of_din_ports;
+	if (num_of_dout_ports != NULL)
+		*num_of_dout_ports = ctx->config.num_of_dout_ports;
+	return 0;
+}
+
+int mx_dout_set_state_ctx(struct mx_dio_ctx *ctx, int doport, int state)
+{
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (doport < 0 || doport >= ctx->config.num_of_dout_ports)
+		return -2; /* E_INVAL */
+
+	if (state != DIO_STATE_LOW && state != DIO_STATE_HIGH)
+		return -2; /* E_INVAL */
+
+	dout_wave_cancel(ctx, 1ULL << doport);
+	return set_dout_state(ctx, doport, state, DIO_RECORD_SRC_SET);
+}
+
+int mx_dout_get_state_ctx(struct mx_dio_ctx *ctx, int doport, int *state)
+{
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (doport < 0 || doport >= ctx->config.num_of_dout_ports)
+		return -2; /* E_INVAL */
+
+	return get_dout_state(ctx, doport, state);
+}
+
+int mx_din_get_state_ctx(struct mx_dio_ctx *ctx, int diport, int *state)
+{
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (diport < 0 || diport >= ctx->config.num_of_din_ports)
+		return -2; /* E_INVAL */
+
+	return get_din_state(ctx, diport, state);
+}
+
+int mx_din_get_all_states_ctx(struct mx_dio_ctx *ctx, uint64_t *bitmap,
+	struct timespec *ts)
+{
+	uint64_t mask;
+
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (bitmap == NULL)
+		return -2; /* E_INVAL */
+
+	if (ts != NULL)
+		clock_gettime(CLOCK_MONOTONIC, ts);
+
+	mask = port_mask_all(ctx->config.num_of_din_ports);
+	if (get_din_multi_state(ctx, mask, bitmap) != mask)
+		return -1; /* E_SYSFUNCERR */
+	return 0;
+}
+
+int mx_dout_set_multi_state_ctx(struct mx_dio_ctx *ctx, uint64_t set_bits,
+	uint64_t clear_bits)
+{
+	uint64_t valid_bits;
+	int ret;
+
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	valid_bits = port_mask_all(ctx->config.num_of_dout_ports);
+	if ((set_bits | clear_bits) & ~valid_bits)
+		return -2; /* E_INVAL */
+
+	if (set_bits & clear_bits)
+		return -2; /* E_INVAL */
+
+	dout_wave_cancel(ctx, set_bits | clear_bits);
+	pthread_mutex_lock(&ctx->dout_multi_lock);
+	ret = set_dout_multi_state(ctx, set_bits, clear_bits, DIO_RECORD_SRC_SET);
+	pthread_mutex_unlock(&ctx->dout_multi_lock);
+
+	return ret;
+}
+
+int mx_dout_set_shadow_ctx(struct mx_dio_ctx *ctx, int enable,
+	unsigned long verify_interval)
+{
+	struct dout_shadow_struct *sh;
+	int ret = 0;
+
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if ((enable != 0 && enable != 1) || verify_interval > INT_MAX)
+		return -2; /* E_INVAL */
+
+	sh = &ctx->dout_shadow;
+	pthread_mutex_lock(&ctx->dout_wave.lock);
+	if (enable && verify_interval != 0)
+		ret = start_dout_wave_thread(ctx);
+	if (ret == 0) {
+		pthread_mutex_lock(&sh->lock);
+		/* levels may have changed while the shadow was not kept */
+		if (enable && !sh->enabled)
+			sh->valid = 0;
+		sh->verify_interval = (uint64_t) verify_interval * 1000000;
+		sh->next_verify = get_monotonic_ns() + sh->verify_interval;
+		__atomic_store_n(&sh->enabled, enable, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&sh->lock);
+		pthread_cond_signal(&ctx->dout_wave.cond);
+	}
+	pthread_mutex_unlock(&ctx->dout_wave.lock);
+
+	return ret;
+}
+
+int mx_dout_get_shadow_ctx(struct mx_dio_ctx *ctx, int *enable,
+	unsigned long *verify_interval)
+{
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (enable == NULL || verify_interval == NULL)
+		return -2; /* E_INVAL */
+
+	pthread_mutex_lock(&ctx->dout_shadow.lock);
+	*enable = ctx->dout_shadow.enabled;
+	*verify_interval = ctx->dout_shadow.verify_interval / 1000000;
+	pthread_mutex_unlock(&ctx->dout_shadow.lock);
+	return 0;
+}
+
+int mx_dout_verify_shadow_ctx(struct mx_dio_ctx *ctx, uint64_t *mismatched)
+{
+	uint64_t changed;
+	int ret;
+
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (!__atomic_load_n(&ctx->dout_shadow.enabled, __ATOMIC_ACQUIRE))
+		return -2; /* E_INVAL */
+
+	changed = dout_shadow_verify(ctx, &ret);
+	if (mismatched != NULL)
+		*mismatched = changed;
+	return ret;
+}
+
+int mx_dout_pulse_ctx(struct mx_dio_ctx *ctx, int doport, unsigned long width)
+{
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (doport < 0 || doport >= ctx->config.num_of_dout_ports)
+		return -2; /* E_INVAL */
+
+	if (width == 0 || width > INT_MAX)
+		return -2; /* E_INVAL */
+
+	return dout_wave_start(ctx, doport, 0, (uint64_t) width * 1000, 1);
+}
+
+int mx_dout_pulse_train_ctx(struct mx_dio_ctx *ctx, int doport,
+	unsigned long period, unsigned long width, unsigned long count)
+{
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (doport < 0 || doport >= ctx->config.num_of_dout_ports)
+		return -2; /* E_INVAL */
+
+	if (width == 0 || width >= period || period > INT_MAX)
+		return -2; /* E_INVAL */
+
+	return dout_wave_start(ctx, doport, (uint64_t) period * 1000,
+		(uint64_t) width * 1000, count);
+}
+
+int mx_dout_pwm_ctx(struct mx_dio_ctx *ctx, int doport, unsigned long period,
+	unsigned int duty)
+{
+	uint64_t width;
+
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (doport < 0 || doport >= ctx->config.num_of_dout_ports)
+		return -2; /* E_INVAL */
+
+	if (period == 0 || period > INT_MAX || duty > 100)
+		return -2; /* E_INVAL */
+
+	/* 0% and 100% have no edges */
+	if (duty == 0 || duty == 100) {
+		dout_wave_cancel(ctx, 1ULL << doport);
+		return set_dout_state(ctx, doport,
+			duty ? DIO_STATE_HIGH : DIO_STATE_LOW, DIO_RECORD_SRC_SET);
+	}
+
+	width = (uint64_t) period * 1000 * duty / 100;
+	return dout_wave_start(ctx, doport, (uint64_t) period * 1000, width, 0);
+}
+
+int mx_dout_stop_pulse_ctx(struct mx_dio_ctx *ctx, int doport)
+{
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (doport < 0 || doport >= ctx->config.num_of_dout_ports)
+		return -2; /* E_INVAL */
+
+	dout_wave_cancel(ctx, 1ULL << doport);
+	return set_dout_state(ctx, doport, DIO_STATE_LOW, DIO_RECORD_SRC_SET);
+}
+
+int mx_dout_get_pulse_stats_ctx(struct mx_dio_ctx *ctx, int doport,
+	struct mx_dout_pulse_stats *stats)
+{
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (doport < 0 || doport >= ctx->config.num_of_dout_ports)
+		return -2; /* E_INVAL */
+
+	if (stats == NULL)
+		return -2; /* E_INVAL */
+
+	pthread_mutex_lock(&ctx->dout_wave.lock);
+	*stats = ctx->dout_wave.ports[doport].stats;
+	pthread_mutex_unlock(&ctx->dout_wave.lock);
+
+	if (stats->pulses == 0)
+		stats->width_min = 0;
+	if (stats->periods == 0)
+		stats->period_min = 0;
+	return 0;
+}
+
+static int set_din_event(struct mx_dio_ctx *ctx, int diport,
+	const struct din_event_callback *cb, int mode, unsigned long duration)
+{
+	static const struct din_event_callback none;
+	int ret = 0;
+
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (diport < 0 || diport >= ctx->config.num_of_din_ports)
+		return -2; /* E_INVAL */
+
+	if (!din_event_callback_is_set(cb) || mode == DIN_EVENT_CLEAR) {
+		din_event_publish(ctx, diport, &none, DIN_EVENT_CLEAR, 0);
+		din_poll_wake(ctx);
+		return 0;
+	}
+
+	if (mode != DIN_EVENT_LOW_TO_HIGH &&
+		mode != DIN_EVENT_HIGH_TO_LOW &&
+		mode != DIN_EVENT_STATE_CHANGE)
+		return -2; /* E_INVAL */
+
+	if (duration != 0 && (duration < 40 || duration > 3600000))
+		return -2; /* E_INVAL */
+
+	din_event_publish(ctx, diport, cb, mode, (uint64_t) duration * 1000000);
+
+	if (!__atomic_load_n(&ctx->din_poll_thread.flag, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&ctx->din_poll_thread.start_lock);
+		if (ctx->din_poll_thread.flag == 0 &&
+			!ctx->din_poll_thread.stop)
+			ret = start_din_poll_thread(ctx);
+		pthread_mutex_unlock(&ctx->din_poll_thread.start_lock);
+		if (ret < 0) {
+			din_event_publish(ctx, diport, &none, DIN_EVENT_CLEAR, 0);
+			return ret;
+		}
+	}
+	din_poll_wake(ctx);
+
+	return 0;
+}
+
+int mx_din_set_event_ctx(struct mx_dio_ctx *ctx, int diport,
+	void (*func)(struct mx_dio_ctx *ctx, int diport, void *arg), void *arg,
+	int mode, unsigned long duration)
+{
+	struct din_event_callback cb = { .func = func, .arg = arg };
+
+	return set_din_event(ctx, diport, &cb, mode, duration);
+}
+
+int mx_din_get_event_ctx(struct mx_dio_ctx *ctx, int diport, int *mode,
+	unsigned long *duration)
+{
+	struct din_event_slot slot;
+
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (diport < 0 || diport >= ctx->config.num_of_din_ports)
+		return -2; /* E_INVAL */
+
+	din_event_read_slot(ctx, diport, &slot);
+	*mode = slot.mode;
+	*duration = slot.duration / 1000000;
+	return 0;
+}
+
+int mx_din_set_counter_ctx(struct mx_dio_ctx *ctx, int diport, int enable)
+{
+	uint64_t bit;
+	int ret = 0;
+
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (diport < 0 || diport >= ctx->config.num_of_din_ports)
+		return -2; /* E_INVAL */
+
+	if (enable != 0 && enable != 1)
+		return -2; /* E_INVAL */
+
+	bit = 1ULL << diport;
+	if (!enable) {
+		__atomic_and_fetch(&ctx->din_counting, ~bit, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	if (!(__atomic_load_n(&ctx->din_counting, __ATOMIC_RELAXED) & bit)) {
+		din_counter_clear(&ctx->din_counter[diport]);
+		__atomic_or_fetch(&ctx->din_counting, bit, __ATOMIC_RELAXED);
+	}
+
+	if (!__atomic_load_n(&ctx->din_poll_thread.flag, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&ctx->din_poll_thread.start_lock);
+		if (ctx->din_poll_thread.flag == 0 &&
+			!ctx->din_poll_thread.stop)
+			ret = start_din_poll_thread(ctx);
+		pthread_mutex_unlock(&ctx->din_poll_thread.start_lock);
+		if (ret < 0) {
+			__atomic_and_fetch(&ctx->din_counting, ~bit, __ATOMIC_RELAXED);
+			return ret;
+		}
+	}
+	din_poll_wake(ctx);
+
+	return 0;
+}
+
+int mx_din_get_counter_ctx(struct mx_dio_ctx *ctx, int diport,
+	struct mx_din_counter *counter)
+{
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (diport < 0 || diport >= ctx->config.num_of_din_ports)
+		return -2; /* E_INVAL */
+
+	if (counter == NULL)
+		return -2; /* E_INVAL */
+
+	din_counter_read(ctx, diport, get_monotonic_ns(), counter);
+	return 0;
+}
+
+/* every counter is consistent in itself, ports are read one after another */
+int mx_din_get_all_counters_ctx(struct mx_dio_ctx *ctx,
+	struct mx_din_counter *counters, size_t max)
+{
+	uint64_t now;
+	int i, n;
 
-	if (diport < 0 || diport >= num_of_din_ports)
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (counters == NULL && max > 0)
 		return -2; /* E_INVAL */
 
-	if (obj_get_str(config, "METHOD", &method) < 0)
-		return -5; /* E_CONFERR */
+	n = ctx->config.num_of_din_ports;
+	if ((size_t) n > max)
+		n = max;
 
-	if (strcmp(method, "IOCTL") == 0)
-		return get_din_state_ioctl(diport, state);
-	else if (strcmp(method, "GPIO") == 0)
-		return get_din_state_gpio(diport, state);
+	now = get_monotonic_ns();
+	for (i = 0; i < n; i++)
+		din_counter_read(ctx, i, now, &counters[i]);
 
-	return -5; /* E_CONFERR */
+	return n;
 }
 
-//int mx_dout_set_multi_state(u32 set_bits, u32 clear_bits);
+int mx_din_reset_counter_ctx(struct mx_dio_ctx *ctx, int diport)
+{
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (diport < 0 || diport >= ctx->config.num_of_din_ports)
+		return -2; /* E_INVAL */
 
-int mx_din_set_event(int diport, void (*func)(int diport), int mode, unsigned long duration)
+	din_counter_clear(&ctx->din_counter[diport]);
+	return 0;
+}
+
+int mx_din_set_event_buffer_ctx(struct mx_dio_ctx *ctx, unsigned int size)
 {
-	int num_of_din_ports;
+	struct mx_din_event *buf = NULL, *old;
+	uint64_t ring_size = 1, old_size;
+	int ret = 0;
 
-	if (!lib_initialized)
+	if (ctx == NULL)
 		return -3; /* E_LIBNOTINIT */
 
-	if (obj_get_int(config, "NUM_OF_DIN_PORTS", &num_of_din_ports) < 0)
-		return -5; /* E_CONFERR */
+	if (size > 0) {
+		while (ring_size < size)
+			ring_size <<= 1;
+
+		buf = (struct mx_din_event *)
+			calloc(ring_size, sizeof(struct mx_din_event));
+		if (buf == NULL)
+			return -1; /* E_SYSFUNCERR */
+	}
+
+	pthread_mutex_lock(&ctx->din_poll_thread.start_lock);
+	if (buf != NULL && ctx->din_poll_thread.memory_locked &&
+		mlock(buf, ring_size * sizeof(struct mx_din_event)) < 0)
+		din_poll_lock_memory(ctx, 0);
+
+	pthread_mutex_lock(&ctx->din_poll_thread.lock);
+	pthread_mutex_lock(&ctx->din_event_ring.read_lock);
+	old = ctx->din_event_ring.buf;
+	old_size = ctx->din_event_ring.size;
+	ctx->din_event_ring.buf = buf;
+	ctx->din_event_ring.size = ring_size;
+	ctx->din_event_ring.head = 0;
+	ctx->din_event_ring.tail = 0;
+	pthread_mutex_unlock(&ctx->din_event_ring.read_lock);
+	pthread_mutex_unlock(&ctx->din_poll_thread.lock);
+
+	if (ctx->din_poll_thread.flag == 0 && !ctx->din_poll_thread.stop &&
+		buf != NULL) {
+		ret = start_din_poll_thread(ctx);
+		if (ret < 0) {
+			ctx->din_event_ring.buf = old;
+			ctx->din_event_ring.size = old_size;
+			old = buf;
+			old_size = ring_size;
+		}
+	}
+	pthread_mutex_unlock(&ctx->din_poll_thread.start_lock);
+	din_poll_wake(ctx);
+
+	if (old != NULL)
+		munlock(old, old_size * sizeof(struct mx_din_event));
+	free(old);
+	return ret;
+}
+
+int mx_din_read_events_ctx(struct mx_dio_ctx *ctx, struct mx_din_event *buf,
+	size_t max)
+{
+	struct din_event_ring_struct *ring;
+	uint64_t head, tail, n, i, cnt;
+
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
 
-	if (diport < 0 || diport >= num_of_din_ports)
+	if (buf == NULL && max > 0)
 		return -2; /* E_INVAL */
 
-	if (func == NULL || mode == DIN_EVENT_CLEAR) {
-		if (din_poll_thread.flag == 0)
-			return 0;
+	if (max > INT_MAX)
+		max = INT_MAX;
+
+	ring = &ctx->din_event_ring;
+	pthread_mutex_lock(&ring->read_lock);
+	if (ring->buf == NULL) {
+		pthread_mutex_unlock(&ring->read_lock);
+		return -2; /* E_INVAL */
+	}
+
+	/* clear event_fd and re-arm it before looking at head */
+	if (ring->event_fd >= 0) {
+		if (read(ring->event_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+			pthread_mutex_unlock(&ring->read_lock);
+			return -1; /* E_SYSFUNCERR */
+		}
+		__atomic_store_n(&ring->armed, 1, __ATOMIC_SEQ_CST);
+	}
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+	n = head - tail;
+	if (n > max)
+		n = max;
 
-		pthread_mutex_lock(&din_poll_thread.lock);
-		din_event[diport].func = NULL;
-		din_event[diport].mode = DIN_EVENT_CLEAR;
-		din_event[diport].duration = 0;
-		pthread_mutex_unlock(&din_poll_thread.lock);
+	for (i = 0; i < n; i++)
+		buf[i] = ring->buf[(tail + i) & (ring->size - 1)];
+
+	__atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+
+	/* records left behind keep event_fd readable */
+	if (ring->event_fd >= 0 && tail + n != head)
+		kick_din_event_fd(ring, ring->event_fd);
+	pthread_mutex_unlock(&ring->read_lock);
+
+	return (int) n;
+}
+
+int mx_din_set_dispatch_threads_ctx(struct mx_dio_ctx *ctx, int num_of_threads)
+{
+	struct din_dispatch_struct *dispatch = NULL, *old;
+
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (num_of_threads < 0 || num_of_threads > MAX_DISPATCH_THREADS)
+		return -2; /* E_INVAL */
+
+	pthread_mutex_lock(&ctx->din_poll_thread.start_lock);
+	if (ctx->din_poll_thread.flag == 0) {
+		ctx->config.din_dispatch_threads = num_of_threads;
+		pthread_mutex_unlock(&ctx->din_poll_thread.start_lock);
 		return 0;
 	}
+	pthread_mutex_unlock(&ctx->din_poll_thread.start_lock);
 
-	if (mode != DIN_EVENT_LOW_TO_HIGH &&
-		mode != DIN_EVENT_HIGH_TO_LOW &&
-		mode != DIN_EVENT_STATE_CHANGE)
+	if (num_of_threads > 0) {
+		dispatch = start_din_dispatch(ctx, num_of_threads);
+		if (dispatch == NULL)
+			return -1; /* E_SYSFUNCERR */
+	}
+
+	pthread_mutex_lock(&ctx->din_poll_thread.lock);
+	old = ctx->din_dispatch;
+	ctx->din_dispatch = dispatch;
+	ctx->config.din_dispatch_threads = num_of_threads;
+	pthread_mutex_unlock(&ctx->din_poll_thread.lock);
+
+	/* outside the lock: queued callbacks may call mx_din_set_event() */
+	if (old != NULL)
+		stop_din_dispatch(old);
+
+	return 0;
+}
+
+int mx_din_get_dispatch_stats_ctx(struct mx_dio_ctx *ctx,
+	struct mx_din_dispatch_stats *stats)
+{
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (stats == NULL)
 		return -2; /* E_INVAL */
 
-	if (duration != 0 && (duration < 40 || duration > 3600000))
+	stats->queued = __atomic_load_n(&ctx->din_dispatch_stats.queued, __ATOMIC_RELAXED);
+	stats->dispatched = __atomic_load_n(&ctx->din_dispatch_stats.dispatched, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&ctx->din_dispatch_stats.dropped, __ATOMIC_RELAXED);
+	stats->queue_depth = __atomic_load_n(&ctx->din_dispatch_stats.queue_depth, __ATOMIC_RELAXED);
+	stats->max_queue_depth = __atomic_load_n(&ctx->din_dispatch_stats.max_queue_depth, __ATOMIC_RELAXED);
+	stats->callback_time_total = __atomic_load_n(&ctx->din_dispatch_stats.callback_time_total, __ATOMIC_RELAXED);
+	stats->callback_time_max = __atomic_load_n(&ctx->din_dispatch_stats.callback_time_max, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int mx_din_set_polling_interval_ctx(struct mx_dio_ctx *ctx, int diport,
+	unsigned long interval)
+{
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (diport < 0 || diport >= ctx->config.num_of_din_ports)
+		return -2; /* E_INVAL */
+
+	if (interval == 0 || interval > INT_MAX)
 		return -2; /* E_INVAL */
 
-	if (din_poll_thread.flag == 0) {
-		pthread_mutex_init(&din_poll_thread.lock, NULL);
+	__atomic_store_n(&ctx->config.din_ports[diport].polling_interval, (int) interval,
+		__ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->din_sched.reset, 1, __ATOMIC_RELEASE);
+	din_poll_wake(ctx);
 
-		din_event[diport].func = func;
-		din_event[diport].mode = mode;
-		din_event[diport].duration = duration * 1000;
-		din_poll_thread.flag = 1;
+	return 0;
+}
 
-		pthread_create(&din_poll_thread.thread, NULL, din_poll, NULL);
-	} else {
-		pthread_mutex_lock(&din_poll_thread.lock);
-		din_event[diport].func = func;
-		din_event[diport].mode = mode;
-		din_event[diport].duration = duration * 1000;
-		pthread_mutex_unlock(&din_poll_thread.lock);
+int mx_din_get_polling_interval_ctx(struct mx_dio_ctx *ctx, int diport,
+	unsigned long *interval)
+{
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (diport < 0 || diport >= ctx->config.num_of_din_ports)
+		return -2; /* E_INVAL */
+
+	*interval = __atomic_load_n(&ctx->config.din_ports[diport].polling_interval,
+		__ATOMIC_RELAXED);
+	return 0;
+}
+
+int mx_din_get_poll_timing_ctx(struct mx_dio_ctx *ctx,
+	struct mx_din_poll_timing *timing)
+{
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (timing == NULL)
+		return -2; /* E_INVAL */
+
+	timing->wakeups = __atomic_load_n(&ctx->din_poll_timing.wakeups, __ATOMIC_RELAXED);
+	timing->jitter_total = __atomic_load_n(&ctx->din_poll_timing.jitter_total, __ATOMIC_RELAXED);
+	timing->jitter_max = __atomic_load_n(&ctx->din_poll_timing.jitter_max, __ATOMIC_RELAXED);
+	timing->overruns = __atomic_load_n(&ctx->din_poll_timing.overruns, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int mx_din_set_poll_thread_attr_ctx(struct mx_dio_ctx *ctx,
+	const struct mx_din_poll_thread_attr *attr)
+{
+	int ret = 0;
+
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (attr == NULL || check_din_poll_thread_attr(attr) < 0)
+		return -2; /* E_INVAL */
+
+	pthread_mutex_lock(&ctx->din_poll_thread.start_lock);
+	ctx->config.din_poll_attr = *attr;
+	if (ctx->din_poll_thread.flag)
+		ret = apply_din_poll_thread_attr(ctx);
+	pthread_mutex_unlock(&ctx->din_poll_thread.start_lock);
+
+	return ret;
+}
+
+int mx_din_get_poll_thread_attr_ctx(struct mx_dio_ctx *ctx,
+	struct mx_din_poll_thread_attr *attr)
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+	void *stack;
+	int cpu;
+
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (attr == NULL)
+		return -2; /* E_INVAL */
+
+	pthread_mutex_lock(&ctx->din_poll_thread.start_lock);
+	*attr = ctx->config.din_poll_attr;
+	if (!ctx->din_poll_thread.flag) {
+		pthread_mutex_unlock(&ctx->din_poll_thread.start_lock);
+		return 0;
 	}
 
+	/* what is in effect on the running thread */
+	if (pthread_getschedparam(ctx->din_poll_thread.thread, &attr->policy, &param) == 0)
+		attr->priority = param.sched_priority;
+	if (pthread_getaffinity_np(ctx->din_poll_thread.thread, sizeof(cpus), &cpus) == 0) {
+		attr->cpus = 0;
+		for (cpu = 0; cpu < 64; cpu++) {
+			if (CPU_ISSET(cpu, &cpus))
+				attr->cpus |= 1ULL << cpu;
+		}
+	}
+	get_thread_stack(ctx->din_poll_thread.thread, &stack, &attr->stack_size);
+	attr->lock_memory = ctx->din_poll_thread.memory_locked;
+	pthread_mutex_unlock(&ctx->din_poll_thread.start_lock);
+
 	return 0;
 }
 
-int mx_din_get_event(int diport, int *mode, unsigned long *duration)
+int mx_din_set_debounce_ctx(struct mx_dio_ctx *ctx, int diport,
+	unsigned int samples)
 {
-	int num_of_din_ports;
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	if (diport < 0 || diport >= ctx->config.num_of_din_ports)
+		return -2; /* E_INVAL */
+
+	if (samples > MAX_DEBOUNCE_SAMPLES)
+		return -2; /* E_INVAL */
+
+	__atomic_store_n(&ctx->config.din_ports[diport].debounce_samples, (int) samples,
+		__ATOMIC_RELAXED);
+	__atomic_or_fetch(&ctx->din_debounce_dirty, 1ULL << diport, __ATOMIC_RELEASE);
+	din_poll_wake(ctx);
+
+	return 0;
+}
 
-	if (!lib_initialized)
+int mx_din_get_debounce_ctx(struct mx_dio_ctx *ctx, int diport,
+	unsigned int *samples)
+{
+	if (ctx == NULL)
 		return -3; /* E_LIBNOTINIT */
 
-	if (obj_get_int(config, "NUM_OF_DIN_PORTS", &num_of_din_ports) < 0)
-		return -5; /* E_CONFERR */
+	if (diport < 0 || diport >= ctx->config.num_of_din_ports)
+		return -2; /* E_INVAL */
+
+	*samples = __atomic_load_n(&ctx->config.din_ports[diport].debounce_samples,
+		__ATOMIC_RELAXED);
+	return 0;
+}
+
+int mx_din_get_event_fd_ctx(struct mx_dio_ctx *ctx)
+{
+	struct din_event_ring_struct *ring;
+	int fd;
+
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	ring = &ctx->din_event_ring;
+	pthread_mutex_lock(&ring->read_lock);
+	if (ring->event_fd < 0) {
+		fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (fd < 0) {
+			pthread_mutex_unlock(&ring->read_lock);
+			return -1; /* E_SYSFUNCERR */
+		}
+		__atomic_store_n(&ring->armed, 1, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&ring->event_fd, fd, __ATOMIC_RELEASE);
+
+		/* records buffered before the fd existed */
+		if (ring->buf != NULL &&
+			__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail)
+			kick_din_event_fd(ring, fd);
+	}
+	fd = ring->event_fd;
+	pthread_mutex_unlock(&ring->read_lock);
+
+	return fd;
+}
+
+int mx_dio_get_stats_ctx(struct mx_dio_ctx *ctx, struct mx_dio_stats *stats)
+{
+	uint64_t *src, *dst;
+	size_t i;
+
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
 
-	if (diport < 0 || diport >= num_of_din_ports)
+	if (stats == NULL)
 		return -2; /* E_INVAL */
 
-	*mode = din_event[diport].mode;
-	*duration = din_event[diport].duration / 1000;
+	/* struct mx_dio_stats is made of uint64_t counters only */
+	src = (uint64_t *) &ctx->stats;
+	dst = (uint64_t *) stats;
+	for (i = 0; i < sizeof(struct mx_dio_stats) / sizeof(uint64_t); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	return 0;
+}
+
+int mx_dio_reset_stats_ctx(struct mx_dio_ctx *ctx)
+{
+	uint64_t *p;
+	size_t i;
+
+	if (ctx == NULL)
+		return -3; /* E_LIBNOTINIT */
+
+	p = (uint64_t *) &ctx->stats;
+	for (i = 0; i < sizeof(struct mx_dio_stats) / sizeof(uint64_t); i++)
+		__atomic_store_n(&p[i], 0, __ATOMIC_RELAXED);
 	return 0;
 }
+
+/*
+ * Legacy APIs, working on the context created by mx_dio_init()
+ */
+
+static inline struct mx_dio_ctx *get_default_ctx(void)
+{
+	return __atomic_load_n(&default_ctx, __ATOMIC_ACQUIRE);
+}
+
+int mx_dio_get_num_of_ports(int *num_of_din_ports, int *num_of_dout_ports)
+{
+	return mx_dio_get_num_of_ports_ctx(get_default_ctx(), num_of_din_ports,
+		num_of_dout_ports);
+}
+
+int mx_dout_set_state(int doport, int state)
+{
+	return mx_dout_set_state_ctx(get_default_ctx(), doport, state);
+}
+
+int mx_dout_get_state(int doport, int *state)
+{
+	return mx_dout_get_state_ctx(get_default_ctx(), doport, state);
+}
+
+int mx_din_get_state(int diport, int *state)
+{
+	return mx_din_get_state_ctx(get_default_ctx(), diport, state);
+}
+
+int mx_din_get_all_states(uint64_t *bitmap, struct timespec *ts)
+{
+	return mx_din_get_all_states_ctx(get_default_ctx(), bitmap, ts);
+}
+
+int mx_dout_set_multi_state(uint64_t set_bits, uint64_t clear_bits)
+{
+	return mx_dout_set_multi_state_ctx(get_default_ctx(), set_bits, clear_bits);
+}
+
+int mx_dout_set_shadow(int enable, unsigned long verify_interval)
+{
+	return mx_dout_set_shadow_ctx(get_default_ctx(), enable, verify_interval);
+}
+
+int mx_dout_get_shadow(int *enable, unsigned long *verify_interval)
+{
+	return mx_dout_get_shadow_ctx(get_default_ctx(), enable, verify_interval);
+}
+
+int mx_dout_verify_shadow(uint64_t *mismatched)
+{
+	return mx_dout_verify_shadow_ctx(get_default_ctx(), mismatched);
+}
+
+int mx_dout_pulse(int doport, unsigned long width)
+{
+	return mx_dout_pulse_ctx(get_default_ctx(), doport, width);
+}
+
+int mx_dout_pulse_train(int doport, unsigned long period, unsigned long width,
+	unsigned long count)
+{
+	return mx_dout_pulse_train_ctx(get_default_ctx(), doport, period, width, count);
+}
+
+int mx_dout_pwm(int doport, unsigned long period, unsigned int duty)
+{
+	return mx_dout_pwm_ctx(get_default_ctx(), doport, period, duty);
+}
+
+int mx_dout_stop_pulse(int doport)
+{
+	return mx_dout_stop_pulse_ctx(get_default_ctx(), doport);
+}
+
+int mx_dout_get_pulse_stats(int doport, struct mx_dout_pulse_stats *stats)
+{
+	return mx_dout_get_pulse_stats_ctx(get_default_ctx(), doport, stats);
+}
+
+int mx_din_set_event(int diport, void (*func)(int diport), int mode, unsigned long duration)
+{
+	struct din_event_callback cb = { .legacy_func = func };
+
+	return set_din_event(get_default_ctx(), diport, &cb, mode, duration);
+}
+
+int mx_din_get_event(int diport, int *mode, unsigned long *duration)
+{
+	return mx_din_get_event_ctx(get_default_ctx(), diport, mode, duration);
+}
+
+int mx_din_set_counter(int diport, int enable)
+{
+	return mx_din_set_counter_ctx(get_default_ctx(), diport, enable);
+}
+
+int mx_din_get_counter(int diport, struct mx_din_counter *counter)
+{
+	return mx_din_get_counter_ctx(get_default_ctx(), diport, counter);
+}
+
+int mx_din_get_all_counters(struct mx_din_counter *counters, size_t max)
+{
+	return mx_din_get_all_counters_ctx(get_default_ctx(), counters, max);
+}
+
+int mx_din_reset_counter(int diport)
+{
+	return mx_din_reset_counter_ctx(get_default_ctx(), diport);
+}
+
+int mx_din_set_event_buffer(unsigned int size)
+{
+	return mx_din_set_event_buffer_ctx(get_default_ctx(), size);
+}
+
+int mx_din_read_events(struct mx_din_event *buf, size_t max)
+{
+	return mx_din_read_events_ctx(get_default_ctx(), buf, max);
+}
+
+int mx_din_set_dispatch_threads(int num_of_threads)
+{
+	return mx_din_set_dispatch_threads_ctx(get_default_ctx(), num_of_threads);
+}
+
+int mx_din_get_dispatch_stats(struct mx_din_dispatch_stats *stats)
+{
+	return mx_din_get_dispatch_stats_ctx(get_default_ctx(), stats);
+}
+
+int mx_din_set_polling_interval(int diport, unsigned long interval)
+{
+	return mx_din_set_polling_interval_ctx(get_default_ctx(), diport, interval);
+}
+
+int mx_din_get_polling_interval(int diport, unsigned long *interval)
+{
+	return mx_din_get_polling_interval_ctx(get_default_ctx(), diport, interval);
+}
+
+int mx_din_get_poll_timing(struct mx_din_poll_timing *timing)
+{
+	return mx_din_get_poll_timing_ctx(get_default_ctx(), timing);
+}
+
+int mx_din_set_poll_thread_attr(const struct mx_din_poll_thread_attr *attr)
+{
+	return mx_din_set_poll_thread_attr_ctx(get_default_ctx(), attr);
+}
+
+int mx_din_get_poll_thread_attr(struct mx_din_poll_thread_attr *attr)
+{
+	return mx_din_get_poll_thread_attr_ctx(get_default_ctx(), attr);
+}
+
+int mx_din_set_debounce(int diport, unsigned int samples)
+{
+	return mx_din_set_debounce_ctx(get_default_ctx(), diport, samples);
+}
+
+int mx_din_get_debounce(int diport, unsigned int *samples)
+{
+	return mx_din_get_debounce_ctx(get_default_ctx(), diport, samples);
+}
+
+int mx_din_get_event_fd(void)
+{
+	return mx_din_get_event_fd_ctx(get_default_ctx());
+}
+
+int mx_dio_get_stats(struct mx_dio_stats *stats)
+{
+	return mx_dio_get_stats_ctx(get_default_ctx(), stats);
+}
+
+int mx_dio_reset_stats(void)
+{
+	return mx_dio_reset_stats_ctx(get_default_ctx());
+}
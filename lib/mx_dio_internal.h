@@ -0,0 +1,200 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Name:
+ *	MOXA DIO Library
+ *
+ * Description:
+ *	Definitions shared by the library core and the DIO backends.
+ */
+
+#ifndef _MOXA_DIO_INTERNAL_H
+#define _MOXA_DIO_INTERNAL_H
+
+#include <stdint.h>
+#include <time.h>
+#include <json-c/json.h>
+#include <mx_dio.h>
+
+#define MAX_FILEPATH_LEN 256	/* reserved length for file path */
+#define MAX_DIO_PORTS MX_DIO_MAX_PORTS	/* upper bound of NUM_OF_DIN/DOUT_PORTS */
+
+#define DIO_INTERNAL __attribute__((visibility("hidden")))
+
+/*
+ * Backend capabilities. The core uses the bulk operations instead of one
+ * call per port when they are available, and waits for DIN edges instead
+ * of polling when a backend reports them.
+ */
+#define DIO_BACKEND_BULK_READ	(1 << 0)	/* read_din_bulk */
+#define DIO_BACKEND_BULK_WRITE	(1 << 1)	/* write_dout_bulk */
+#define DIO_BACKEND_EDGE_EVENTS	(1 << 2)	/* start/wait/stop_events */
+
+#define MAX_DIN_EDGES 64	/* edges returned by one wait_events call */
+
+struct din_edge {
+	int diport;
+	int state;
+	uint64_t ts;	/* CLOCK_MONOTONIC, in ns */
+};
+
+struct dio_backend_ops;
+
+/*
+ * What a backend sees of a context. priv belongs to the backend: it is
+ * set up by init and released by close.
+ */
+struct dio_backend {
+	const struct dio_backend_ops *ops;
+	void *priv;
+	int num_of_din_ports;
+	int num_of_dout_ports;
+	int wake_fd;	/* eventfd kicked to end wait_events early */
+};
+
+/*
+ * Operations of a DIO backend, selected by the METHOD key of the config
+ * once when a context is opened. Port numbers are already range checked.
+ * Functions return 0 or a negative E_xxx error code unless noted.
+ */
+struct dio_backend_ops {
+	const char *name;	/* METHOD in the config */
+	unsigned int caps;	/* DIO_BACKEND_xxx */
+
+	int (*init)(struct dio_backend *be, struct json_object *conf);
+	void (*close)(struct dio_backend *be);
+
+	int (*read_din)(struct dio_backend *be, int diport, int *state);
+	int (*read_dout)(struct dio_backend *be, int doport, int *state);
+	int (*write_dout)(struct dio_backend *be, int doport, int state);
+
+	/* DIO_BACKEND_BULK_READ: returns the mask of ports read */
+	uint64_t (*read_din_bulk)(struct dio_backend *be, uint64_t mask,
+		uint64_t *bitmap);
+	/* DIO_BACKEND_BULK_WRITE */
+	int (*write_dout_bulk)(struct dio_backend *be, uint64_t set_bits,
+		uint64_t clear_bits);
+
+	/*
+	 * DIO_BACKEND_EDGE_EVENTS, called on the DIN poll thread only.
+	 * wait_events blocks until a watched DIN port changes, deadline
+	 * (CLOCK_MONOTONIC in ns, UINT64_MAX for none) passes or wake_fd is
+	 * kicked, which sets *woken. Returns the number of edges stored in
+	 * edges, oldest first, or -1.
+	 */
+	int (*start_events)(struct dio_backend *be);
+	int (*wait_events)(struct dio_backend *be, uint64_t watched,
+		uint64_t deadline, struct din_edge *edges, int max_edges,
+		int *woken);
+	void (*stop_events)(struct dio_backend *be);
+};
+
+extern DIO_INTERNAL const struct dio_backend_ops dio_backend_ioctl;
+extern DIO_INTERNAL const struct dio_backend_ops dio_backend_gpio;
+extern DIO_INTERNAL const struct dio_backend_ops dio_backend_sim;
+#ifdef HAVE_GPIO_V2
+extern DIO_INTERNAL const struct dio_backend_ops dio_backend_gpiochip;
+#endif
+
+/*
+ * Sequence-of-events recorder, see recorder.c. dio_recorder_add may be
+ * called from any thread.
+ */
+struct dio_recorder;
+
+extern DIO_INTERNAL int dio_recorder_open(const char *path, unsigned int records,
+	struct dio_recorder **rec);
+extern DIO_INTERNAL void dio_recorder_close(struct dio_recorder *rec);
+extern DIO_INTERNAL void dio_recorder_add(struct dio_recorder *rec, uint64_t ts,
+	int port, int direction, int old_state, int new_state, int source);
+
+static inline uint64_t get_monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+/*
+ * json-c utilities
+ */
+
+static inline int obj_get_obj(struct json_object *obj, char *key, struct json_object **val)
+{
+	if (!json_object_object_get_ex(obj, key, val))
+		return -1;
+	return 0;
+}
+
+static inline int obj_get_int(struct json_object *obj, char *key, int *val)
+{
+	struct json_object *tmp;
+
+	if (obj_get_obj(obj, key, &tmp) < 0)
+		return -1;
+
+	*val = json_object_get_int(tmp);
+	return 0;
+}
+
+static inline int obj_get_str(struct json_object *obj, char *key, const char **val)
+{
+	struct json_object *tmp;
+
+	if (obj_get_obj(obj, key, &tmp) < 0)
+		return -1;
+
+	*val = json_object_get_string(tmp);
+	return 0;
+}
+
+static inline int obj_get_arr(struct json_object *obj, char *key, struct array_list **val)
+{
+	struct json_object *tmp;
+
+	if (obj_get_obj(obj, key, &tmp) < 0)
+		return -1;
+
+	*val = json_object_get_array(tmp);
+	return 0;
+}
+
+static inline int arr_get_obj(struct array_list *arr, int idx, struct json_object **val)
+{
+	if (arr == NULL || idx < 0 || (size_t) idx >= arr->length)
+		return -1;
+
+	*val = array_list_get_idx(arr, idx);
+	return 0;
+}
+
+static inline int arr_get_arr(struct array_list *arr, int idx, struct array_list **val)
+{
+	struct json_object *tmp;
+
+	if (arr_get_obj(arr, idx, &tmp) < 0)
+		return -1;
+
+	*val = json_object_get_array(tmp);
+	return 0;
+}
+
+static inline int arr_get_int(struct array_list *arr, int idx, int *val)
+{
+	struct json_object *tmp;
+
+	if (arr_get_obj(arr, idx, &tmp) < 0)
+		return -1;
+
+	*val = json_object_get_int(tmp);
+	return 0;
+}
+
+#endif /* _MOXA_DIO_INTERNAL_H */
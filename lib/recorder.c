@@ -0,0 +1,167 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Name:
+ *	MOXA DIO Library
+ *
+ * Description:
+ *	Sequence-of-events recorder: DIN/DOUT transitions appended to a
+ *	memory-mapped circular file, see struct mx_dio_recorder_header.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mx_dio_internal.h"
+
+#define BOOT_ID_FILE "/proc/sys/kernel/random/boot_id"
+
+/*
+ * Appending a record is an atomic increment of the head in the file plus
+ * stores into the mapping: no system call, no lock and no formatting. The
+ * seq of a slot is cleared while the slot is written and stored last, so
+ * readers, even in other processes, skip slots caught half written.
+ */
+struct dio_recorder {
+	struct mx_dio_recorder_header *hdr;
+	struct mx_dio_record *records;
+	uint64_t mask;		/* capacity - 1 */
+	size_t size;		/* of the mapping */
+};
+
+static void read_boot_id(char *boot_id, size_t len)
+{
+	ssize_t n = -1;
+	int fd;
+
+	memset(boot_id, 0, len);
+	fd = open(BOOT_ID_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		n = read(fd, boot_id, len - 1);
+		close(fd);
+	}
+	if (n > 0 && boot_id[n - 1] == '\n')
+		boot_id[n - 1] = '\0';
+}
+
+static int64_t get_realtime_offset(void)
+{
+	struct timespec rt;
+	uint64_t mono;
+
+	mono = get_monotonic_ns();
+	clock_gettime(CLOCK_REALTIME, &rt);
+	return (int64_t) ((uint64_t) rt.tv_sec * 1000000000ULL + rt.tv_nsec - mono);
+}
+
+/*
+ * A file left by an earlier run of the same boot, with the same geometry,
+ * is appended to, so restarting an application does not lose the records
+ * that led to the restart. Anything else is started over.
+ */
+int dio_recorder_open(const char *path, unsigned int records,
+	struct dio_recorder **rec_out)
+{
+	struct mx_dio_recorder_header *hdr;
+	struct dio_recorder *rec;
+	char boot_id[sizeof(hdr->boot_id)];
+	uint64_t capacity = 1;
+	struct stat st;
+	size_t size;
+	void *map;
+	int fd, reuse;
+
+	if (path == NULL || records == 0)
+		return -2; /* E_INVAL */
+
+	while (capacity < records)
+		capacity <<= 1;
+	size = sizeof(struct mx_dio_recorder_header) +
+		capacity * sizeof(struct mx_dio_record);
+
+	rec = (struct dio_recorder *) calloc(1, sizeof(struct dio_recorder));
+	if (rec == NULL)
+		return -1; /* E_SYSFUNCERR */
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		goto err_free;
+
+	if (fstat(fd, &st) < 0)
+		goto err_close;
+
+	reuse = (st.st_size == (off_t) size);
+	if (!reuse && (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0))
+		goto err_close;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto err_close;
+	close(fd);
+
+	hdr = (struct mx_dio_recorder_header *) map;
+	read_boot_id(boot_id, sizeof(boot_id));
+	if (reuse)
+		reuse = memcmp(hdr->magic, MX_DIO_RECORDER_MAGIC, sizeof(hdr->magic)) == 0 &&
+			hdr->version == MX_DIO_RECORDER_VERSION &&
+			hdr->record_size == sizeof(struct mx_dio_record) &&
+			hdr->capacity == capacity &&
+			memcmp(hdr->boot_id, boot_id, sizeof(boot_id)) == 0;
+
+	if (!reuse) {
+		memset(map, 0, size);
+		hdr->version = MX_DIO_RECORDER_VERSION;
+		hdr->record_size = sizeof(struct mx_dio_record);
+		hdr->capacity = capacity;
+		memcpy(hdr->boot_id, boot_id, sizeof(boot_id));
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memcpy(hdr->magic, MX_DIO_RECORDER_MAGIC, sizeof(hdr->magic));
+	}
+	hdr->realtime_offset = get_realtime_offset();
+
+	rec->hdr = hdr;
+	rec->records = (struct mx_dio_record *) (hdr + 1);
+	rec->mask = capacity - 1;
+	rec->size = size;
+	*rec_out = rec;
+	return 0;
+
+err_close:
+	close(fd);
+err_free:
+	free(rec);
+	return -1; /* E_SYSFUNCERR */
+}
+
+void dio_recorder_close(struct dio_recorder *rec)
+{
+	if (rec == NULL)
+		return;
+
+	munmap(rec->hdr, rec->size);
+	free(rec);
+}
+
+void dio_recorder_add(struct dio_recorder *rec, uint64_t ts, int port,
+	int direction, int old_state, int new_state, int source)
+{
+	struct mx_dio_record *r;
+	uint64_t seq;
+
+	seq = __atomic_add_fetch(&rec->hdr->head, 1, __ATOMIC_RELAXED);
+	r = &rec->records[(seq - 1) & rec->mask];
+
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	r->timestamp = ts;
+	r->port = port;
+	r->direction = direction;
+	r->old_state = old_state;
+	r->new_state = new_state;
+	r->source = source;
+	__atomic_store_n(&r->seq, seq, __ATOMIC_RELEASE);
+}
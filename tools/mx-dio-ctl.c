@@ -16,10 +16,26 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <mx_dio.h>
 
 #define UNSET -1
+#define MAX_BATCH_LINE 256
+#define MAX_BATCH_ARGS 4
+#define WAIT_RECHECK_MS 100	/* wait-for-state rereads the port this often */
+#define WATCH_BUFFER_SIZE 4096	/* DIN event buffer records */
+#define WATCH_READ_CHUNK 256
+#define WATCH_OUTPUT_BUFFER (256 * 1024)
+#define BENCH_EVENT_BUFFER 64
 
 enum action_type {
 	GET_DOUT = 0,
@@ -36,20 +52,101 @@ struct action_struct {
 	int version;
 	int type;
 	int port;
+	const char *ports;	/* -i/-o argument: N, N-M or all */
 	int state;
 };
 
+struct port_range {
+	int first;
+	int last;
+};
+
+enum watch_format {
+	WATCH_CSV = 0,
+	WATCH_JSON = 1
+};
+
+/* per DIN port, reset at every summary except last_ts/last_state */
+struct watch_port_struct {
+	uint64_t transitions;
+	uint64_t last_ts;	/* of the last transition, 0 if none yet */
+	int last_state;		/* UNSET until the first transition */
+	uint64_t min_width;	/* in ns, UINT64_MAX if none */
+	uint64_t max_width;
+	uint64_t dropped;	/* records of this port lost to buffer overruns */
+	uint64_t interval;	/* polling interval in ns, 0 if unknown */
+	uint64_t shorts;	/* pulses narrower than two polling intervals */
+};
+
+struct watch_struct {
+	int format;
+	struct port_range range;
+	uint64_t next_seq;
+	uint64_t dropped;	/* records lost to buffer overruns */
+	uint64_t overruns;	/* poll timing overruns at the last summary */
+	uint64_t period_start;	/* in ms */
+	struct watch_port_struct ports[MX_DIO_MAX_PORTS];
+};
+
+enum bench_format {
+	BENCH_TEXT = 0,
+	BENCH_JSON = 1
+};
+
+struct bench_struct {
+	int format;
+	int diport;
+	int doport;
+	long iterations;
+	long warmup;		/* untimed runs before each measurement */
+	uint64_t timeout;	/* DIN port following the DOUT port, in ns */
+	uint64_t *samples;	/* iterations long, in ns */
+};
+
+enum log_format {
+	LOG_CSV = 0,
+	LOG_JSON = 1
+};
+
+struct log_struct {
+	int format;
+	uint64_t din_ports;	/* ports to show */
+	uint64_t dout_ports;
+	unsigned int sources;	/* 1 << DIO_RECORD_SRC_xxx to show */
+	int64_t realtime_offset;
+};
+
+static const char *log_sources[] = {
+	[DIO_RECORD_SRC_SAMPLE] = "sample",
+	[DIO_RECORD_SRC_EVENT] = "event",
+	[DIO_RECORD_SRC_SET] = "set",
+	[DIO_RECORD_SRC_PULSE] = "pulse",
+};
+
+#define NUM_OF_LOG_SOURCES (sizeof(log_sources) / sizeof(log_sources[0]))
+
+static volatile sig_atomic_t watch_stop;
+
 void usage(FILE *fp)
 {
 	fprintf(fp, "Usage:\n");
-	fprintf(fp, "	mx-dio-ctl <-i|-o <#port number> [-s <#state>]>\n\n");
+	fprintf(fp, "	mx-dio-ctl <-i|-o <#port number> [-s <#state>]> [-S]\n");
+	fprintf(fp, "	mx-dio-ctl batch [-S] [<script file>]\n");
+	fprintf(fp, "	mx-dio-ctl watch [-i <#ports>] [-f csv|json] [-p <#seconds>] [-t <#seconds>]\n");
+	fprintf(fp, "	mx-dio-ctl bench [-o <#DOUT port>] [-i <#DIN port>] [-n <#iterations>]\n");
+	fprintf(fp, "		[-w <#iterations>] [-t <#ms>] [-f text|json] [-r]\n");
+	fprintf(fp, "	mx-dio-ctl log [-i <#DIN ports>] [-o <#DOUT ports>] [-s <#sources>]\n");
+	fprintf(fp, "		[-n <#records>] [-f csv|json] <recorder file>\n\n");
 	fprintf(fp, "OPTIONS:\n");
 	fprintf(fp, "	-i <#DIN port number>\n");
 	fprintf(fp, "	-o <#DOUT port number>\n");
+	fprintf(fp, "		A port number, a range like 0-15, or all\n");
 	fprintf(fp, "	-s <#state>\n");
-	fprintf(fp, "		Set state for target DOUT port\n");
+	fprintf(fp, "		Set state for target DOUT ports\n");
 	fprintf(fp, "		0 --> LOW\n");
 	fprintf(fp, "		1 --> HIGH\n");
+	fprintf(fp, "	-S\n");
+	fprintf(fp, "		Dump library statistics after the action\n");
 	fprintf(fp, "\n");
 	fprintf(fp, "Example:\n");
 	fprintf(fp, "	Get value from DIN port 0\n");
@@ -61,6 +158,56 @@ void usage(FILE *fp)
 	fprintf(fp, "	# mx-dio-ctl -o 0 -s 0\n");
 	fprintf(fp, "	Set DOUT port 0 value to HIGH\n");
 	fprintf(fp, "	# mx-dio-ctl -o 0 -s 1\n");
+	fprintf(fp, "	Get values from all DIN ports\n");
+	fprintf(fp, "	# mx-dio-ctl -i all\n");
+	fprintf(fp, "	Set DOUT port 0 to 3 value to HIGH\n");
+	fprintf(fp, "	# mx-dio-ctl -o 0-3 -s 1\n");
+	fprintf(fp, "\n");
+	fprintf(fp, "BATCH:\n");
+	fprintf(fp, "	Run the commands of a script file, or of stdin, one per line,\n");
+	fprintf(fp, "	with a single library instance. Stops at the first error.\n");
+	fprintf(fp, "	get din|dout <ports>         prints \"din|dout <port> <state>\"\n");
+	fprintf(fp, "	set <ports> <state>          prints \"dout <port> <state>\"\n");
+	fprintf(fp, "	multi-set <set> <clear>      DOUT port bitmaps, one access\n");
+	fprintf(fp, "	sleep <ms>\n");
+	fprintf(fp, "	wait-for-state <port> <state> [<timeout ms>]\n");
+	fprintf(fp, "	                             prints \"din <port> <state> <waited ms>\"\n");
+	fprintf(fp, "	# comment\n");
+	fprintf(fp, "\n");
+	fprintf(fp, "WATCH:\n");
+	fprintf(fp, "	Stream DIN transitions to stdout and print summaries to stderr\n");
+	fprintf(fp, "	until interrupted.\n");
+	fprintf(fp, "	-i <#DIN ports>   ports to show, default all\n");
+	fprintf(fp, "	-f csv|json       record format, default csv\n");
+	fprintf(fp, "	-p <#seconds>     summary period, default 1, 0 for none\n");
+	fprintf(fp, "	-t <#seconds>     stop after this long, default 0 for never\n");
+	fprintf(fp, "\n");
+	fprintf(fp, "BENCH:\n");
+	fprintf(fp, "	Measure the DIO limits of the device. The DOUT port must be wired\n");
+	fprintf(fp, "	to the DIN port, as for example/dio-test.c, unless -r is given.\n");
+	fprintf(fp, "	-o <#DOUT port>    port to toggle, default 0\n");
+	fprintf(fp, "	-i <#DIN port>     port to read, default 0\n");
+	fprintf(fp, "	-n <#iterations>   samples per measurement, default 1000\n");
+	fprintf(fp, "	-w <#iterations>   untimed warmup runs, default 100\n");
+	fprintf(fp, "	-t <#ms>           loopback timeout, default 1000\n");
+	fprintf(fp, "	-f text|json       report format, default text\n");
+	fprintf(fp, "	-r                 toggle and read rates only, no wiring needed\n");
+	fprintf(fp, "	Reports per measurement: samples, rate/s and min, p50, p99, max\n");
+	fprintf(fp, "	and jitter (p99 - p50) in ns of\n");
+	fprintf(fp, "	dout_toggle     one DOUT set\n");
+	fprintf(fp, "	din_read        one DIN read\n");
+	fprintf(fp, "	loopback        DOUT set until a DIN read returns the new level\n");
+	fprintf(fp, "	loopback_event  DOUT set until the DIN edge detected by the library\n");
+	fprintf(fp, "\n");
+	fprintf(fp, "LOG:\n");
+	fprintf(fp, "	Decode the records of a RECORDER_FILE, oldest first. Needs no\n");
+	fprintf(fp, "	library instance, so the file can be read after the fact.\n");
+	fprintf(fp, "	-i <#DIN ports>   DIN ports to show, default all unless -o is given\n");
+	fprintf(fp, "	-o <#DOUT ports>  DOUT ports to show, default all unless -i is given\n");
+	fprintf(fp, "	-s <#sources>     comma separated sample, event, set, pulse,\n");
+	fprintf(fp, "	                  default all\n");
+	fprintf(fp, "	-n <#records>     newest records only\n");
+	fprintf(fp, "	-f csv|json       record format, default csv\n");
 }
 
 int my_atoi(const char *nptr, int *number)
@@ -80,45 +227,1277 @@ int my_atoi(const char *nptr, int *number)
 	return -1;
 }
 
-void do_action(struct action_struct action)
+static int parse_long(const char *str, long *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtol(str, &end, 0);
+	if (errno != 0 || end == str || *end != '\0')
+		return -1;
+	return 0;
+}
+
+/* N, N-M or all; ports must be below num_of_ports */
+static int parse_ports(const char *str, int num_of_ports, struct port_range *range)
+{
+	char buf[32], *dash;
+	long first, last;
+
+	if (strcmp(str, "all") == 0) {
+		if (num_of_ports == 0)
+			return -1;
+		range->first = 0;
+		range->last = num_of_ports - 1;
+		return 0;
+	}
+
+	if (strlen(str) >= sizeof(buf))
+		return -1;
+	strcpy(buf, str);
+
+	dash = strchr(buf, '-');
+	if (dash != NULL)
+		*dash = '\0';
+
+	if (parse_long(buf, &first) < 0)
+		return -1;
+	last = first;
+	if (dash != NULL && parse_long(dash + 1, &last) < 0)
+		return -1;
+
+	if (first < 0 || first > last || last >= num_of_ports)
+		return -1;
+
+	range->first = first;
+	range->last = last;
+	return 0;
+}
+
+static void print_hist(const char *name, struct mx_dio_hist *h)
+{
+	int i;
+
+	if (h->count == 0)
+		return;
+
+	printf("%s: count %llu avg %llu ns max %llu ns\n", name,
+		(unsigned long long) h->count,
+		(unsigned long long) (h->total / h->count),
+		(unsigned long long) h->max);
+	for (i = 0; i < MX_DIO_HIST_BUCKETS; i++) {
+		if (h->buckets[i] == 0)
+			continue;
+		printf("	[%llu, %llu) ns: %llu\n",
+			(i == 0) ? 0ULL : 1ULL << i, 1ULL << (i + 1),
+			(unsigned long long) h->buckets[i]);
+	}
+}
+
+static void print_op_stats(const char *name, struct mx_dio_op_stats *op)
+{
+	printf("%s: calls %llu errors %llu\n", name,
+		(unsigned long long) op->calls,
+		(unsigned long long) op->errors);
+	print_hist("	latency", &op->latency);
+}
+
+void dump_stats(void)
+{
+	struct mx_dio_stats stats;
+	int i;
+
+	if (mx_dio_get_stats(&stats) < 0) {
+		fprintf(stderr, "Failed to get statistics\n");
+		exit(1);
+	}
+
+	print_op_stats("din_read", &stats.din_read);
+	print_op_stats("dout_read", &stats.dout_read);
+	print_op_stats("dout_write", &stats.dout_write);
+	printf("dout_cached_reads: %llu\n", (unsigned long long) stats.dout_cached_reads);
+	printf("dout_verifies: %llu mismatches %llu\n",
+		(unsigned long long) stats.dout_verifies,
+		(unsigned long long) stats.dout_mismatches);
+	print_hist("poll_cycle", &stats.poll_cycle);
+	printf("poll_overruns: %llu\n", (unsigned long long) stats.poll_overruns);
+	print_hist("event_latency", &stats.event_latency_all);
+	for (i = 0; i < MX_DIO_MAX_PORTS; i++) {
+		if (stats.event_latency[i].count == 0)
+			continue;
+		printf("	DIN port %d: count %llu avg %llu ns max %llu ns\n", i,
+			(unsigned long long) stats.event_latency[i].count,
+			(unsigned long long) (stats.event_latency[i].total /
+				stats.event_latency[i].count),
+			(unsigned long long) stats.event_latency[i].max);
+	}
+}
+
+static inline uint64_t range_mask(struct port_range range)
+{
+	uint64_t mask = (range.last == 63) ? ~0ULL : (1ULL << (range.last + 1)) - 1;
+
+	return mask & ~((1ULL << range.first) - 1);
+}
+
+/* a range is read with one mx_din_get_all_states() */
+static int get_din_range(struct port_range range, uint64_t *bitmap)
+{
+	int state;
+
+	if (range.first == range.last) {
+		if (mx_din_get_state(range.first, &state) < 0)
+			return -1;
+		*bitmap = (uint64_t) state << range.first;
+		return 0;
+	}
+	return mx_din_get_all_states(bitmap, NULL);
+}
+
+/* a range is set with one mx_dout_set_multi_state() */
+static int set_dout_range(struct port_range range, int state)
+{
+	if (range.first == range.last)
+		return mx_dout_set_state(range.first, state);
+
+	if (state == DIO_STATE_HIGH)
+		return mx_dout_set_multi_state(range_mask(range), 0);
+	return mx_dout_set_multi_state(0, range_mask(range));
+}
+
+void do_action(struct action_struct action, struct port_range range)
 {
+	uint64_t bitmap;
+	int port;
+
 	switch (action.type) {
 	case GET_DIN:
-		if (mx_din_get_state(action.port, &action.state) < 0) {
+		if (get_din_range(range, &bitmap) < 0) {
 			fprintf(stderr, "Failed to get DIN state\n");
 			exit(1);
 		}
-		printf("DIN port %d state: %d\n", action.port, action.state);
+		for (port = range.first; port <= range.last; port++)
+			printf("DIN port %d state: %d\n", port, (int) ((bitmap >> port) & 1));
 		break;
 	case GET_DOUT:
-		if (mx_dout_get_state(action.port, &action.state) < 0) {
-			fprintf(stderr, "Failed to get DOUT state\n");
-			exit(1);
+		for (port = range.first; port <= range.last; port++) {
+			if (mx_dout_get_state(port, &action.state) < 0) {
+				fprintf(stderr, "Failed to get DOUT state\n");
+				exit(1);
+			}
+			printf("DOUT port %d state: %d\n", port, action.state);
 		}
-		printf("DOUT port %d state: %d\n", action.port, action.state);
 		break;
 	case SET_DOUT:
-		if (mx_dout_set_state(action.port, action.state) < 0) {
+		if (set_dout_range(range, action.state) < 0) {
 			fprintf(stderr, "Failed to set DOUT state\n");
 			exit(1);
 		}
-		printf("DOUT port %d state: %d\n", action.port, action.state);
+		for (port = range.first; port <= range.last; port++)
+			printf("DOUT port %d state: %d\n", port, action.state);
 		break;
 	}
 }
 
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Returns 0 once the DIN port reads state, 1 on timeout (timeout_ms < 0
+ * waits forever) and -1 on error. Transitions are picked up from the DIN
+ * event buffer, and the port is reread now and then in case the change
+ * happened before the poll thread took its first sample.
+ */
+static int wait_for_din_state(int port, int state, long timeout_ms)
+{
+	struct mx_din_event events[16];
+	struct pollfd pfd;
+	uint64_t start = now_ms(), elapsed;
+	int cur, wait, n, i, ret = 0;
+
+	if (mx_din_set_event_buffer(64) < 0)
+		return -1;
+
+	pfd.fd = mx_din_get_event_fd();
+	pfd.events = POLLIN;
+	if (pfd.fd < 0 || mx_din_get_state(port, &cur) < 0) {
+		mx_din_set_event_buffer(0);
+		return -1;
+	}
+
+	while (cur != state) {
+		elapsed = now_ms() - start;
+		if (timeout_ms >= 0 && elapsed >= (uint64_t) timeout_ms) {
+			ret = 1;
+			break;
+		}
+
+		wait = WAIT_RECHECK_MS;
+		if (timeout_ms >= 0 && (uint64_t) timeout_ms - elapsed < (uint64_t) wait)
+			wait = timeout_ms - elapsed;
+
+		n = poll(&pfd, 1, wait);
+		if (n < 0 && errno != EINTR) {
+			ret = -1;
+			break;
+		}
+
+		if (n == 0) {
+			if (mx_din_get_state(port, &cur) < 0) {
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+
+		n = mx_din_read_events(events, sizeof(events) / sizeof(events[0]));
+		if (n < 0) {
+			ret = -1;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].port == (unsigned int) port)
+				cur = events[i].new_state;
+		}
+	}
+
+	mx_din_set_event_buffer(0);
+	return ret;
+}
+
+static void batch_error(int lineno, const char *msg, int code)
+{
+	fflush(stdout);
+	fprintf(stderr, "line %d: %s\n", lineno, msg);
+	exit(code);
+}
+
+static int batch_state(const char *str)
+{
+	long state;
+
+	if (parse_long(str, &state) < 0 || (state != DIO_STATE_LOW && state != DIO_STATE_HIGH))
+		return -1;
+	return state;
+}
+
+static void batch_command(int lineno, char **argv, int argc,
+	int num_of_din_ports, int num_of_dout_ports)
+{
+	struct port_range range;
+	struct timespec ts;
+	uint64_t bitmap, set_bits, clear_bits, start;
+	long val, timeout;
+	int state, port;
+	char *end;
+
+	if (strcmp(argv[0], "get") == 0 && argc == 3 && strcmp(argv[1], "din") == 0) {
+		if (parse_ports(argv[2], num_of_din_ports, &range) < 0)
+			batch_error(lineno, "invalid DIN ports", 99);
+		if (get_din_range(range, &bitmap) < 0)
+			batch_error(lineno, "failed to get DIN state", 1);
+		for (port = range.first; port <= range.last; port++)
+			printf("din %d %d\n", port, (int) ((bitmap >> port) & 1));
+	} else if (strcmp(argv[0], "get") == 0 && argc == 3 && strcmp(argv[1], "dout") == 0) {
+		if (parse_ports(argv[2], num_of_dout_ports, &range) < 0)
+			batch_error(lineno, "invalid DOUT ports", 99);
+		for (port = range.first; port <= range.last; port++) {
+			if (mx_dout_get_state(port, &state) < 0)
+				batch_error(lineno, "failed to get DOUT state", 1);
+			printf("dout %d %d\n", port, state);
+		}
+	} else if (strcmp(argv[0], "set") == 0 && argc == 3) {
+		if (parse_ports(argv[1], num_of_dout_ports, &range) < 0)
+			batch_error(lineno, "invalid DOUT ports", 99);
+		state = batch_state(argv[2]);
+		if (state < 0)
+			batch_error(lineno, "invalid state", 99);
+		if (set_dout_range(range, state) < 0)
+			batch_error(lineno, "failed to set DOUT state", 1);
+		for (port = range.first; port <= range.last; port++)
+			printf("dout %d %d\n", port, state);
+	} else if (strcmp(argv[0], "multi-set") == 0 && argc == 3) {
+		errno = 0;
+		set_bits = strtoull(argv[1], &end, 0);
+		if (errno != 0 || *end != '\0')
+			batch_error(lineno, "invalid set bitmap", 99);
+		clear_bits = strtoull(argv[2], &end, 0);
+		if (errno != 0 || *end != '\0')
+			batch_error(lineno, "invalid clear bitmap", 99);
+		if (mx_dout_set_multi_state(set_bits, clear_bits) < 0)
+			batch_error(lineno, "failed to set DOUT states", 1);
+		for (port = 0; port < num_of_dout_ports; port++) {
+			if ((set_bits | clear_bits) & (1ULL << port))
+				printf("dout %d %d\n", port, (int) ((set_bits >> port) & 1));
+		}
+	} else if (strcmp(argv[0], "sleep") == 0 && argc == 2) {
+		if (parse_long(argv[1], &val) < 0 || val < 0)
+			batch_error(lineno, "invalid time", 99);
+		fflush(stdout);
+		ts.tv_sec = val / 1000;
+		ts.tv_nsec = (val % 1000) * 1000000;
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			;
+	} else if (strcmp(argv[0], "wait-for-state") == 0 && (argc == 3 || argc == 4)) {
+		if (parse_long(argv[1], &val) < 0 || val < 0 || val >= num_of_din_ports)
+			batch_error(lineno, "invalid DIN port", 99);
+		state = batch_state(argv[2]);
+		if (state < 0)
+			batch_error(lineno, "invalid state", 99);
+		timeout = -1;
+		if (argc == 4 && (parse_long(argv[3], &timeout) < 0 || timeout < 0))
+			batch_error(lineno, "invalid timeout", 99);
+		fflush(stdout);
+
+		start = now_ms();
+		switch (wait_for_din_state(val, state, timeout)) {
+		case 0:
+			break;
+		case 1:
+			batch_error(lineno, "timed out", 1);
+			break;
+		default:
+			batch_error(lineno, "failed to wait for DIN state", 1);
+			break;
+		}
+		printf("din %ld %d %llu\n", val, state, (unsigned long long) (now_ms() - start));
+	} else {
+		batch_error(lineno, "unknown command", 99);
+	}
+}
+
+/*
+ * Output is line buffered only towards a terminal, so it is flushed before
+ * anything that blocks, for a reader waiting on a pipe.
+ */
+void run_batch(FILE *fp)
+{
+	char line[MAX_BATCH_LINE], *argv[MAX_BATCH_ARGS + 1], *save, *tok;
+	int num_of_din_ports, num_of_dout_ports, lineno = 0, argc;
+
+	if (mx_dio_get_num_of_ports(&num_of_din_ports, &num_of_dout_ports) < 0) {
+		fprintf(stderr, "Failed to get the number of ports\n");
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if (strchr(line, '\n') == NULL && !feof(fp))
+			batch_error(lineno, "line too long", 99);
+
+		tok = strchr(line, '#');
+		if (tok != NULL)
+			*tok = '\0';
+
+		argc = 0;
+		for (tok = strtok_r(line, " \t\r\n", &save); tok != NULL;
+			tok = strtok_r(NULL, " \t\r\n", &save)) {
+			if (argc == MAX_BATCH_ARGS)
+				batch_error(lineno, "too many arguments", 99);
+			argv[argc++] = tok;
+		}
+		if (argc == 0)
+			continue;
+
+		batch_command(lineno, argv, argc, num_of_din_ports, num_of_dout_ports);
+	}
+}
+
+int batch_main(int argc, char *argv[])
+{
+	FILE *fp = stdin;
+	int show_stats = 0;
+	int c;
+
+	while (1) {
+		c = getopt(argc, argv, "hS");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			usage(stdout);
+			exit(0);
+		case 'S':
+			show_stats = 1;
+			break;
+		default:
+			usage(stderr);
+			exit(99);
+		}
+	}
+
+	if (argc - optind > 1) {
+		usage(stderr);
+		exit(99);
+	}
+
+	if (optind < argc && strcmp(argv[optind], "-") != 0) {
+		fp = fopen(argv[optind], "r");
+		if (fp == NULL) {
+			fprintf(stderr, "Failed to open %s\n", argv[optind]);
+			exit(1);
+		}
+	}
+
+	if (mx_dio_init() < 0) {
+		fprintf(stderr, "Initialize Moxa dio control library failed\n");
+		exit(1);
+	}
+
+	run_batch(fp);
+	if (show_stats)
+		dump_stats();
+
+	exit(0);
+}
+
+static void watch_signal(int sig)
+{
+	(void) sig;
+	watch_stop = 1;
+}
+
+static void watch_reset_period(struct watch_struct *w)
+{
+	struct mx_din_poll_timing timing;
+	unsigned long interval;
+	int i;
+
+	for (i = 0; i < MX_DIO_MAX_PORTS; i++) {
+		w->ports[i].transitions = 0;
+		w->ports[i].min_width = UINT64_MAX;
+		w->ports[i].max_width = 0;
+		w->ports[i].dropped = 0;
+		w->ports[i].shorts = 0;
+		if (mx_din_get_polling_interval(i, &interval) == 0)
+			w->ports[i].interval = (uint64_t) interval * 1000;
+	}
+	w->dropped = 0;
+	if (mx_din_get_poll_timing(&timing) == 0)
+		w->overruns = timing.overruns;
+	w->period_start = now_ms();
+}
+
+static void watch_summary(struct watch_struct *w)
+{
+	struct watch_port_struct *wp;
+	struct mx_din_poll_timing timing;
+	uint64_t elapsed = now_ms() - w->period_start, overruns = 0;
+	int port;
+
+	if (elapsed == 0)
+		elapsed = 1;
+	if (mx_din_get_poll_timing(&timing) == 0)
+		overruns = timing.overruns - w->overruns;
+
+	fprintf(stderr, "summary %llu ms: dropped %llu, poll overruns %llu\n",
+		(unsigned long long) elapsed, (unsigned long long) w->dropped,
+		(unsigned long long) overruns);
+	for (port = w->range.first; port <= w->range.last; port++) {
+		wp = &w->ports[port];
+		if (wp->transitions == 0 && wp->dropped == 0)
+			continue;
+
+		fprintf(stderr, "	DIN port %d: %.1f transitions/s", port,
+			wp->transitions * 1000.0 / elapsed);
+		if (wp->min_width != UINT64_MAX)
+			fprintf(stderr, ", pulse width min %.1f us max %.1f us",
+				wp->min_width / 1000.0, wp->max_width / 1000.0);
+		fprintf(stderr, ", dropped %llu", (unsigned long long) wp->dropped);
+		if (wp->interval != 0)
+			fprintf(stderr, ", short %llu (interval %.1f us)",
+				(unsigned long long) wp->shorts, wp->interval / 1000.0);
+		fprintf(stderr, "\n");
+	}
+}
+
+static void watch_record(struct watch_struct *w, struct mx_din_event *ev)
+{
+	struct watch_port_struct *wp;
+	uint64_t width;
+
+	/* the buffer consumes a sequence number even for a dropped record */
+	if (w->next_seq != 0 && ev->seq > w->next_seq)
+		w->dropped += ev->seq - w->next_seq;
+	w->next_seq = ev->seq + 1;
+
+	if (ev->port < w->range.first || ev->port > w->range.last)
+		return;
+	wp = &w->ports[ev->port];
+
+	/* the record before this one on the same port was dropped */
+	if (wp->last_state != UNSET && ev->old_state != wp->last_state)
+		wp->dropped++;
+
+	/*
+	 * A pulse narrower than the polling interval can start and end between
+	 * two reads and is not seen at all. Pulses seen within two intervals
+	 * mean the input runs close to that limit, and narrower ones are lost.
+	 */
+	if (wp->last_ts != 0) {
+		width = ev->timestamp - wp->last_ts;
+		if (width < 2 * wp->interval)
+			wp->shorts++;
+		if (width < wp->min_width)
+			wp->min_width = width;
+		if (width > wp->max_width)
+			wp->max_width = width;
+	}
+	wp->last_ts = ev->timestamp;
+	wp->last_state = ev->new_state;
+	wp->transitions++;
+
+	if (w->format == WATCH_JSON)
+		printf("{\"timestamp\": %llu, \"port\": %u, \"old_state\": %u, \"new_state\": %u}\n",
+			(unsigned long long) ev->timestamp, ev->port, ev->old_state, ev->new_state);
+	else
+		printf("%llu,%u,%u,%u\n", (unsigned long long) ev->timestamp,
+			ev->port, ev->old_state, ev->new_state);
+}
+
+/*
+ * Records come from the DIN event buffer, so no callback runs per edge.
+ * stdout is fully buffered and only flushed once the event buffer has been
+ * drained: at high edge rates many records go out in one write.
+ */
+int watch_main(int argc, char *argv[])
+{
+	static struct mx_din_event events[WATCH_READ_CHUNK];
+	static struct watch_struct w;
+	struct sigaction sa;
+	struct pollfd pfd;
+	const char *ports = "all";
+	long period = 1, duration = 0, val;
+	uint64_t start, now, next_summary = UINT64_MAX, end = UINT64_MAX, wake;
+	int num_of_ports, timeout, summarized = 0, n, i, c;
+
+	w.format = WATCH_CSV;
+	while (1) {
+		c = getopt(argc, argv, "hi:f:p:t:");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			usage(stdout);
+			exit(0);
+		case 'i':
+			ports = optarg;
+			break;
+		case 'f':
+			if (strcmp(optarg, "csv") == 0) {
+				w.format = WATCH_CSV;
+			} else if (strcmp(optarg, "json") == 0) {
+				w.format = WATCH_JSON;
+			} else {
+				fprintf(stderr, "unknown format %s\n", optarg);
+				exit(99);
+			}
+			break;
+		case 'p':
+		case 't':
+			if (parse_long(optarg, &val) < 0 || val < 0) {
+				fprintf(stderr, "%s is not a number of seconds\n", optarg);
+				exit(99);
+			}
+			if (c == 'p')
+				period = val;
+			else
+				duration = val;
+			break;
+		default:
+			usage(stderr);
+			exit(99);
+		}
+	}
+
+	if (optind < argc) {
+		usage(stderr);
+		exit(99);
+	}
+
+	if (mx_dio_init() < 0) {
+		fprintf(stderr, "Initialize Moxa dio control library failed\n");
+		exit(1);
+	}
+
+	mx_dio_get_num_of_ports(&num_of_ports, NULL);
+	if (parse_ports(ports, num_of_ports, &w.range) < 0) {
+		fprintf(stderr, "%s is not a valid port or port range\n", ports);
+		exit(1);
+	}
+
+	for (i = 0; i < MX_DIO_MAX_PORTS; i++) {
+		w.ports[i].last_state = UNSET;
+		w.ports[i].last_ts = 0;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = watch_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	setvbuf(stdout, NULL, _IOFBF, WATCH_OUTPUT_BUFFER);
+
+	if (mx_din_set_event_buffer(WATCH_BUFFER_SIZE) < 0) {
+		fprintf(stderr, "Failed to set DIN event buffer\n");
+		exit(1);
+	}
+
+	pfd.fd = mx_din_get_event_fd();
+	pfd.events = POLLIN;
+	if (pfd.fd < 0) {
+		fprintf(stderr, "Failed to get DIN event fd\n");
+		exit(1);
+	}
+
+	if (w.format == WATCH_CSV)
+		printf("timestamp,port,old_state,new_state\n");
+
+	watch_reset_period(&w);
+	start = now_ms();
+	if (period > 0)
+		next_summary = start + period * 1000;
+	if (duration > 0)
+		end = start + duration * 1000;
+
+	while (!watch_stop) {
+		now = now_ms();
+		wake = (next_summary < end) ? next_summary : end;
+		if (wake == UINT64_MAX)
+			timeout = -1;
+		else
+			timeout = (wake > now) ? (int) (wake - now) : 0;
+
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+			fprintf(stderr, "Failed to wait for DIN events\n");
+			exit(1);
+		}
+
+		do {
+			n = mx_din_read_events(events, WATCH_READ_CHUNK);
+			if (n < 0) {
+				fprintf(stderr, "Failed to read DIN events\n");
+				exit(1);
+			}
+			for (i = 0; i < n; i++)
+				watch_record(&w, &events[i]);
+		} while (n == WATCH_READ_CHUNK);
+		fflush(stdout);
+
+		now = now_ms();
+		summarized = 0;
+		if (now >= next_summary) {
+			summarized = 1;
+			watch_summary(&w);
+			watch_reset_period(&w);
+			next_summary += period * 1000;
+			if (next_summary <= now)
+				next_summary = now + period * 1000;
+		}
+		if (now >= end)
+			break;
+	}
+
+	fflush(stdout);
+	if (period > 0 && !summarized)
+		watch_summary(&w);
+
+	exit(0);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* elapsed covers the timed iterations, in ns */
+static void bench_report(struct bench_struct *b, const char *name, uint64_t elapsed)
+{
+	uint64_t *s = b->samples;
+	size_t n = b->iterations;
+	unsigned long long min, p50, p99, max;
+	double rate;
+
+	qsort(s, n, sizeof(uint64_t), cmp_u64);
+	min = s[0];
+	p50 = s[n / 2];
+	p99 = s[n * 99 / 100];
+	max = s[n - 1];
+	rate = n * 1e9 / (elapsed ? elapsed : 1);
+
+	if (b->format == BENCH_JSON)
+		printf("{\"bench\": \"%s\", \"samples\": %zu, \"rate\": %.0f, "
+			"\"min_ns\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+			"\"max_ns\": %llu, \"jitter_ns\": %llu}\n",
+			name, n, rate, min, p50, p99, max, p99 - p50);
+	else
+		printf("%-15s %9zu %10.0f %10llu %10llu %10llu %10llu %10llu\n",
+			name, n, rate, min, p50, p99, max, p99 - p50);
+	fflush(stdout);
+}
+
+static int bench_dout_toggle(struct bench_struct *b)
+{
+	uint64_t start = 0, t;
+	int state = DIO_STATE_LOW;
+	long i;
+
+	for (i = -b->warmup; i < b->iterations; i++) {
+		if (i == 0)
+			start = now_ns();
+		state = !state;
+		t = now_ns();
+		if (mx_dout_set_state(b->doport, state) < 0) {
+			fprintf(stderr, "Failed to set DOUT port %d\n", b->doport);
+			return -1;
+		}
+		if (i >= 0)
+			b->samples[i] = now_ns() - t;
+	}
+
+	bench_report(b, "dout_toggle", now_ns() - start);
+	return 0;
+}
+
+static int bench_din_read(struct bench_struct *b)
+{
+	uint64_t start = 0, t;
+	int state;
+	long i;
+
+	for (i = -b->warmup; i < b->iterations; i++) {
+		if (i == 0)
+			start = now_ns();
+		t = now_ns();
+		if (mx_din_get_state(b->diport, &state) < 0) {
+			fprintf(stderr, "Failed to get DIN port %d\n", b->diport);
+			return -1;
+		}
+		if (i >= 0)
+			b->samples[i] = now_ns() - t;
+	}
+
+	bench_report(b, "din_read", now_ns() - start);
+	return 0;
+}
+
+static void bench_no_loopback(struct bench_struct *b)
+{
+	fprintf(stderr, "DIN port %d did not follow DOUT port %d within %llu ms: are they wired?\n",
+		b->diport, b->doport, (unsigned long long) (b->timeout / 1000000));
+}
+
+/*
+ * Sets the DOUT port and reads the DIN port back to back until it returns
+ * state. Returns 0, 1 on timeout or -1 on error.
+ */
+static int loopback_read(struct bench_struct *b, int state, uint64_t *latency)
+{
+	uint64_t start, now;
+	int cur;
+
+	start = now_ns();
+	if (mx_dout_set_state(b->doport, state) < 0)
+		return -1;
+
+	do {
+		if (mx_din_get_state(b->diport, &cur) < 0)
+			return -1;
+		now = now_ns();
+		if (cur != state && now - start >= b->timeout)
+			return 1;
+	} while (cur != state);
+
+	*latency = now - start;
+	return 0;
+}
+
+static int bench_loopback(struct bench_struct *b)
+{
+	uint64_t start = 0, latency;
+	int state = DIO_STATE_LOW, ret;
+	long i;
+
+	/* settle at LOW first, so that every sample below is an edge */
+	for (i = -b->warmup - 1; i < b->iterations; i++) {
+		if (i == 0)
+			start = now_ns();
+		ret = loopback_read(b, state, &latency);
+		if (ret != 0) {
+			if (ret > 0)
+				bench_no_loopback(b);
+			else
+				fprintf(stderr, "Failed to access DOUT port %d or DIN port %d\n",
+					b->doport, b->diport);
+			return -1;
+		}
+		if (i >= 0)
+			b->samples[i] = latency;
+		state = !state;
+	}
+
+	bench_report(b, "loopback", now_ns() - start);
+	return 0;
+}
+
+/*
+ * Sets the DOUT port and waits for the DIN event buffer to record the edge.
+ * The latency runs up to the timestamp of the record, so it does not
+ * include waking up this thread. Returns 0, 1 on timeout or -1 on error.
+ */
+static int loopback_event(struct bench_struct *b, struct pollfd *pfd, int state,
+	uint64_t *latency)
+{
+	struct mx_din_event events[BENCH_EVENT_BUFFER];
+	uint64_t start, elapsed;
+	int n, i;
+
+	do {
+		n = mx_din_read_events(events, BENCH_EVENT_BUFFER);
+		if (n < 0)
+			return -1;
+	} while (n == BENCH_EVENT_BUFFER);
+
+	start = now_ns();
+	if (mx_dout_set_state(b->doport, state) < 0)
+		return -1;
+
+	while (1) {
+		elapsed = now_ns() - start;
+		if (elapsed >= b->timeout)
+			return 1;
+
+		n = poll(pfd, 1, (b->timeout - elapsed) / 1000000 + 1);
+		if (n < 0 && errno != EINTR)
+			return -1;
+
+		n = mx_din_read_events(events, BENCH_EVENT_BUFFER);
+		if (n < 0)
+			return -1;
+		for (i = 0; i < n; i++) {
+			if (events[i].port != (unsigned int) b->diport ||
+				events[i].new_state != state)
+				continue;
+			*latency = (events[i].timestamp > start) ?
+				events[i].timestamp - start : 0;
+			return 0;
+		}
+	}
+}
+
+static int bench_loopback_event(struct bench_struct *b)
+{
+	struct pollfd pfd;
+	uint64_t start = 0, latency;
+	int state, ret = 0;
+	long i;
+
+	if (mx_din_set_event_buffer(BENCH_EVENT_BUFFER) < 0) {
+		fprintf(stderr, "Failed to set DIN event buffer\n");
+		return -1;
+	}
+
+	pfd.fd = mx_din_get_event_fd();
+	pfd.events = POLLIN;
+	if (pfd.fd < 0 || mx_din_get_state(b->diport, &state) < 0) {
+		fprintf(stderr, "Failed to get DIN port %d\n", b->diport);
+		ret = -1;
+		goto out;
+	}
+	/* let the poll thread take the first sample */
+	usleep(100000);
+
+	for (i = -b->warmup; i < b->iterations; i++) {
+		if (i == 0)
+			start = now_ns();
+		state = !state;
+		ret = loopback_event(b, &pfd, state, &latency);
+		if (ret != 0) {
+			if (ret > 0)
+				bench_no_loopback(b);
+			else
+				fprintf(stderr, "Failed to access DOUT port %d or DIN port %d\n",
+					b->doport, b->diport);
+			ret = -1;
+			goto out;
+		}
+		if (i >= 0)
+			b->samples[i] = latency;
+	}
+
+	bench_report(b, "loopback_event", now_ns() - start);
+out:
+	mx_din_set_event_buffer(0);
+	return ret;
+}
+
+int bench_main(int argc, char *argv[])
+{
+	struct bench_struct b = {
+		.format = BENCH_TEXT,
+		.diport = 0,
+		.doport = 0,
+		.iterations = 1000,
+		.warmup = 100,
+		.timeout = 1000 * 1000000ULL
+	};
+	int num_of_din_ports, num_of_dout_ports;
+	int rates_only = 0, saved, ret, c;
+	long val;
+
+	while (1) {
+		c = getopt(argc, argv, "ho:i:n:w:t:f:r");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			usage(stdout);
+			exit(0);
+		case 'o':
+		case 'i':
+		case 'n':
+		case 'w':
+		case 't':
+			if (parse_long(optarg, &val) < 0 || val < 0 ||
+				(c == 'n' && val == 0) || val > INT_MAX) {
+				fprintf(stderr, "%s is not a valid number\n", optarg);
+				exit(99);
+			}
+			if (c == 'o')
+				b.doport = val;
+			else if (c == 'i')
+				b.diport = val;
+			else if (c == 'n')
+				b.iterations = val;
+			else if (c == 'w')
+				b.warmup = val;
+			else
+				b.timeout = val * 1000000ULL;
+			break;
+		case 'f':
+			if (strcmp(optarg, "text") == 0) {
+				b.format = BENCH_TEXT;
+			} else if (strcmp(optarg, "json") == 0) {
+				b.format = BENCH_JSON;
+			} else {
+				fprintf(stderr, "unknown format %s\n", optarg);
+				exit(99);
+			}
+			break;
+		case 'r':
+			rates_only = 1;
+			break;
+		default:
+			usage(stderr);
+			exit(99);
+		}
+	}
+
+	if (optind < argc) {
+		usage(stderr);
+		exit(99);
+	}
+
+	if (mx_dio_init() < 0) {
+		fprintf(stderr, "Initialize Moxa dio control library failed\n");
+		exit(1);
+	}
+
+	mx_dio_get_num_of_ports(&num_of_din_ports, &num_of_dout_ports);
+	if (b.diport >= num_of_din_ports || b.doport >= num_of_dout_ports) {
+		fprintf(stderr, "DIN port %d or DOUT port %d does not exist\n",
+			b.diport, b.doport);
+		exit(1);
+	}
+
+	b.samples = (uint64_t *) calloc(b.iterations, sizeof(uint64_t));
+	if (b.samples == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	if (mx_dout_get_state(b.doport, &saved) < 0) {
+		fprintf(stderr, "Failed to get DOUT port %d\n", b.doport);
+		exit(1);
+	}
+
+	if (b.format == BENCH_TEXT)
+		printf("%-15s %9s %10s %10s %10s %10s %10s %10s\n", "bench", "samples",
+			"rate/s", "min ns", "p50 ns", "p99 ns", "max ns", "jitter ns");
+
+	ret = bench_dout_toggle(&b);
+	if (ret == 0)
+		ret = bench_din_read(&b);
+	if (ret == 0 && !rates_only)
+		ret = bench_loopback(&b);
+	if (ret == 0 && !rates_only)
+		ret = bench_loopback_event(&b);
+
+	if (mx_dout_set_state(b.doport, saved) < 0) {
+		fprintf(stderr, "Failed to restore DOUT port %d\n", b.doport);
+		ret = -1;
+	}
+
+	free(b.samples);
+	exit(ret < 0 ? 1 : 0);
+}
+
+static int parse_log_sources(const char *str, unsigned int *sources)
+{
+	char buf[64], *tok, *save;
+	unsigned int i;
+
+	if (strlen(str) >= sizeof(buf))
+		return -1;
+	strcpy(buf, str);
+
+	*sources = 0;
+	for (tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < NUM_OF_LOG_SOURCES; i++) {
+			if (strcmp(tok, log_sources[i]) == 0)
+				break;
+		}
+		if (i == NUM_OF_LOG_SOURCES)
+			return -1;
+		*sources |= 1U << i;
+	}
+	return (*sources == 0) ? -1 : 0;
+}
+
+static void log_record(struct log_struct *l, struct mx_dio_record *r)
+{
+	const char *dir = (r->direction == DIO_RECORD_DIN) ? "din" : "dout";
+	const char *source = (r->source < NUM_OF_LOG_SOURCES) ? log_sources[r->source] : "unknown";
+	uint64_t ports = (r->direction == DIO_RECORD_DIN) ? l->din_ports : l->dout_ports;
+	char realtime[48], old_state[8];
+	uint64_t rt;
+	time_t sec;
+	struct tm tm;
+
+	if (r->port >= MX_DIO_MAX_PORTS || !(ports & (1ULL << r->port)))
+		return;
+	if (r->source < NUM_OF_LOG_SOURCES && !(l->sources & (1U << r->source)))
+		return;
+
+	rt = r->timestamp + l->realtime_offset;
+	sec = rt / 1000000000ULL;
+	gmtime_r(&sec, &tm);
+	strftime(realtime, sizeof(realtime), "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(realtime + strlen(realtime), sizeof(realtime) - strlen(realtime),
+		".%09lluZ", (unsigned long long) (rt % 1000000000ULL));
+
+	if (l->format == LOG_JSON) {
+		if (r->old_state == DIO_RECORD_STATE_UNKNOWN)
+			strcpy(old_state, "null");
+		else
+			snprintf(old_state, sizeof(old_state), "%u", r->old_state);
+		printf("{\"seq\": %llu, \"timestamp\": %llu, \"realtime\": \"%s\", "
+			"\"direction\": \"%s\", \"port\": %u, \"old_state\": %s, "
+			"\"new_state\": %u, \"source\": \"%s\"}\n",
+			(unsigned long long) r->seq, (unsigned long long) r->timestamp,
+			realtime, dir, r->port, old_state, r->new_state, source);
+	} else {
+		if (r->old_state == DIO_RECORD_STATE_UNKNOWN)
+			old_state[0] = '\0';
+		else
+			snprintf(old_state, sizeof(old_state), "%u", r->old_state);
+		printf("%llu,%llu,%s,%s,%u,%s,%u,%s\n",
+			(unsigned long long) r->seq, (unsigned long long) r->timestamp,
+			realtime, dir, r->port, old_state, r->new_state, source);
+	}
+}
+
+/*
+ * The file is mapped read-only, so it can be read while an application is
+ * still recording into it. A slot is copied and its seq checked again
+ * afterwards: a record overwritten meanwhile is counted as lost.
+ */
+int log_main(int argc, char *argv[])
+{
+	static struct log_struct l;
+	struct mx_dio_recorder_header hdr;
+	struct mx_dio_record *records, *slot, r;
+	struct port_range range;
+	struct stat st;
+	const char *din_ports = NULL, *dout_ports = NULL;
+	uint64_t head, seq, first, count = 0, lost = 0;
+	long val;
+	void *map;
+	int fd, c;
+
+	l.format = LOG_CSV;
+	l.sources = ~0U;
+	while (1) {
+		c = getopt(argc, argv, "hi:o:s:n:f:");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			usage(stdout);
+			exit(0);
+		case 'i':
+			din_ports = optarg;
+			break;
+		case 'o':
+			dout_ports = optarg;
+			break;
+		case 's':
+			if (parse_log_sources(optarg, &l.sources) < 0) {
+				fprintf(stderr, "%s is not a list of sources\n", optarg);
+				exit(99);
+			}
+			break;
+		case 'n':
+			if (parse_long(optarg, &val) < 0 || val <= 0) {
+				fprintf(stderr, "%s is not a number of records\n", optarg);
+				exit(99);
+			}
+			count = val;
+			break;
+		case 'f':
+			if (strcmp(optarg, "csv") == 0) {
+				l.format = LOG_CSV;
+			} else if (strcmp(optarg, "json") == 0) {
+				l.format = LOG_JSON;
+			} else {
+				fprintf(stderr, "unknown format %s\n", optarg);
+				exit(99);
+			}
+			break;
+		default:
+			usage(stderr);
+			exit(99);
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(stderr);
+		exit(99);
+	}
+
+	if (din_ports == NULL && dout_ports == NULL) {
+		l.din_ports = ~0ULL;
+		l.dout_ports = ~0ULL;
+	}
+	if (din_ports != NULL) {
+		if (parse_ports(din_ports, MX_DIO_MAX_PORTS, &range) < 0) {
+			fprintf(stderr, "%s is not a valid port or port range\n", din_ports);
+			exit(99);
+		}
+		l.din_ports = range_mask(range);
+	}
+	if (dout_ports != NULL) {
+		if (parse_ports(dout_ports, MX_DIO_MAX_PORTS, &range) < 0) {
+			fprintf(stderr, "%s is not a valid port or port range\n", dout_ports);
+			exit(99);
+		}
+		l.dout_ports = range_mask(range);
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", argv[optind], strerror(errno));
+		exit(1);
+	}
+	if ((size_t) st.st_size < sizeof(hdr)) {
+		fprintf(stderr, "%s is not a recorder file\n", argv[optind]);
+		exit(1);
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s: %s\n", argv[optind], strerror(errno));
+		exit(1);
+	}
+	close(fd);
+
+	memcpy(&hdr, map, sizeof(hdr));
+	if (memcmp(hdr.magic, MX_DIO_RECORDER_MAGIC, sizeof(hdr.magic)) != 0 ||
+		hdr.version != MX_DIO_RECORDER_VERSION ||
+		hdr.record_size != sizeof(struct mx_dio_record) ||
+		hdr.capacity == 0 || (hdr.capacity & (hdr.capacity - 1)) != 0 ||
+		(uint64_t) st.st_size != sizeof(hdr) + hdr.capacity * sizeof(struct mx_dio_record)) {
+		fprintf(stderr, "%s is not a recorder file\n", argv[optind]);
+		exit(1);
+	}
+	l.realtime_offset = hdr.realtime_offset;
+	records = (struct mx_dio_record *) ((char *) map + sizeof(hdr));
+
+	head = __atomic_load_n(&((struct mx_dio_recorder_header *) map)->head, __ATOMIC_ACQUIRE);
+	first = (head > hdr.capacity) ? head - hdr.capacity + 1 : 1;
+	if (count != 0 && head >= count && head - count + 1 > first)
+		first = head - count + 1;
+
+	if (l.format == LOG_CSV)
+		printf("seq,timestamp,realtime,direction,port,old_state,new_state,source\n");
+
+	for (seq = first; seq <= head; seq++) {
+		slot = &records[(seq - 1) & (hdr.capacity - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) {
+			lost++;
+			continue;
+		}
+		memcpy(&r, slot, sizeof(r));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq || r.seq != seq) {
+			lost++;
+			continue;
+		}
+		log_record(&l, &r);
+	}
+
+	fflush(stdout);
+	if (lost)
+		fprintf(stderr, "%llu records overwritten or incomplete\n",
+			(unsigned long long) lost);
+
+	exit(0);
+}
+
 int main(int argc, char *argv[])
 {
 	struct action_struct action = {
 		.version = UNSET,
 		.type = UNSET,
 		.port = UNSET,
+		.ports = NULL,
 		.state = UNSET
 	};
+	struct port_range range;
+	int num_of_ports;
+	int show_stats = 0;
 	int c;
 
+	if (argc > 1 && strcmp(argv[1], "batch") == 0)
+		return batch_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "watch") == 0)
+		return watch_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+		return bench_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "log") == 0)
+		return log_main(argc - 1, argv + 1);
+
 	while (1) {
-		c = getopt(argc, argv, "hg:s:n:i:o:");
+		c = getopt(argc, argv, "hg:s:n:i:o:S");
 		if (c == -1)
 			break;
 
@@ -151,10 +1530,7 @@ int main(int argc, char *argv[])
 			}
 			action.version = ACTION_VER_NEW;
 			action.type = GET_DIN;
-			if (my_atoi(optarg, &action.port) != 0) {
-				fprintf(stderr, "%s is not a number\n", optarg);
-				exit(1);
-			}
+			action.ports = optarg;
 			break;
 		case 'o':
 			if (action.version != UNSET) {
@@ -164,10 +1540,7 @@ int main(int argc, char *argv[])
 			}
 			action.version = ACTION_VER_NEW;
 			action.type = GET_DOUT;
-			if (my_atoi(optarg, &action.port) != 0) {
-				fprintf(stderr, "%s is not a number\n", optarg);
-				exit(1);
-			}
+			action.ports = optarg;
 			break;
 		case 's':
 			if (action.type != UNSET && action.version == ACTION_VER_OLD) {
@@ -192,6 +1565,9 @@ int main(int argc, char *argv[])
 				exit(1);
 			}
 			break;
+		case 'S':
+			show_stats = 1;
+			break;
 		default:
 			usage(stderr);
 			exit(99);
@@ -214,7 +1590,7 @@ int main(int argc, char *argv[])
 		exit(99);
 	}
 
-	if (action.port == UNSET) {
+	if (action.port == UNSET && action.ports == NULL) {
 		fprintf(stderr, "port number is unset\n");
 		usage(stderr);
 		exit(99);
@@ -225,7 +1601,24 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	do_action(action);
+	if (action.ports != NULL) {
+		if (action.type == GET_DIN)
+			mx_dio_get_num_of_ports(&num_of_ports, NULL);
+		else
+			mx_dio_get_num_of_ports(NULL, &num_of_ports);
+
+		if (parse_ports(action.ports, num_of_ports, &range) < 0) {
+			fprintf(stderr, "%s is not a valid port or port range\n", action.ports);
+			exit(1);
+		}
+	} else {
+		range.first = action.port;
+		range.last = action.port;
+	}
+
+	do_action(action, range);
+	if (show_stats)
+		dump_stats();
 
 	exit(0);
 }